@@ -11,16 +11,51 @@
 #include <omp.h> /* openmp header */
 #include <limits.h>
 #include <float.h>
+#include <unistd.h> /* fork/exec for the local worker launcher */
+#include <sys/wait.h>
+#include <sys/resource.h> /* peak memory use in the telemetry snapshots */
 #include <xraylib.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
+#include <gsl/gsl_cdf.h>
 #include <complex.h> //complex numbers required for Fresnel equation (reflect)
 
 #define NELEM 92  /* The maximum number of elements possible  */
 #define IDIM 1000 /* The maximum number of capillary segments */
 #define NDIM 420  /* The number of scattering factors per element */
-#define NSPOT 1000  /* The number of bins in the grid for the spot*/
+#define NSPOT 1000  /* The default number of bins in the grid for the spot*/
+#define SPOT_TILE 32 /* The number of bins along x and y in one spot map tile */
+#define NSCREEN 100 /* The maximum number of additional screen planes */
+#define NSTAT_MOM 9 /* The number of weighted exit moments per energy: 1, x, y, x^2, y^2, dx, dy, dx^2, dy^2 */
+#define NANG 500 /* The number of bins along each axis of the exit direction histogram */
+#define ANG_MAX 0.1 /* The default half width of the exit direction histogram [rad] */
+#define NSYM 12 /* The order of the symmetry group of an on-axis hexagonal polycapillary */
+#define NQMC 5 /* The number of quasi-random dimensions used in start() */
+#define QMC_NDIG 53 /* The number of scrambled digits per quasi-random coordinate */
+#define QMC_BMAX 11 /* The largest Halton base in use */
 #define IMSIZE 500001
+#define NSRC_ANG 1024 /* The number of intervals the angular emission profile of the source is resampled to */
+#define SRC_DISK 0 /* Source models: uniform disk of radius src_x (the source of the input file) */
+#define SRC_GAUSS 1 /* elliptical Gaussian */
+#define SRC_ELLIPSE 2 /* uniform ellipse */
+#define SRC_IMAGE 3 /* measured intensity image */
+#define NCHAN_BAND 4 /* The number of energy bands of the channel map */
+#define NCHAN_REC (4+NCHAN_BAND) /* The number of channel map accumulators per channel: entered, exited, bounces, absorbed, band weights */
+#define NTUNE 16 /* The maximum number of settings measured by the autotuner */
+#define TUNE_SHARE 0.1 /* The share of the run time the autotuner spends in calibration bursts (at ideal scaling) */
+#define TUNE_DROP 0.8 /* Larger thread counts are not measured once one runs below this share of the best rate */
+#define COMPARE_ALPHA 1e-3 /* The significance level below which -compare reports a deviation */
+#define COMPARE_NBIN 50 /* The maximum number of bins along x and y of the spot maps compared by chi-square */
+#define COMPARE_MINW 5. /* The minimal combined weight of a bin compared by chi-square */
+#define MEM_PAGE 4096 /* The size of a memory page [bytes], per-thread state is aligned and padded to it */
+#define NPOLY 10 /* The maximum degree of a polynomial parametric profile */
+#define SHAPE_NSTEP 64 /* The minimal number of steps along a parametric capillary when searching wall intersections */
+#define SHAPE_NSAMPLE 999 /* The number of intervals of the absorption profile of parametric shapes */
+#define SHAPE_POLYNOMIAL 0 /* Parametric profile types; straight and conical profiles are stored as polynomials */
+#define SHAPE_ELLIPSOIDAL 1
+#define SHAPE_PARABOLOIDAL 2
+#define K_GENERIC 1 /* Tracing kernel flags: run time check (cap->spots) instead of the fixed spot output below */
+#define K_SPOTS 2 /* spot maps are accumulated */
 //#define CALFA 4.15189e-4   /* E = [KEV] ! */
 //#define CBETA 9.86643e-9   /* E = [KEV] ! */
 //#define C 299792458//light speed [m/s]
@@ -29,6 +64,22 @@
 #define R0 2.8179403227e-13 //classical electron radius [cm]
 #define DELTA 1.e-10
 #define EPSILON 1.0e-30
+#define PART_MAGIC "PCPART5" /* identifies partial result files of distributed runs */
+#define HIST_MAGIC "PCHIST2" /* identifies bounce history files */
+#define HIST_BUF 1048576 /* size of the per-thread bounce history output buffer [bytes] */
+#define EXITW_MAGIC "PCEXIT1" /* identifies per-photon exit weight files */
+#define ZCACHE_MAGIC "PCZCACHE2" /* identifies z-plane photon state caches */
+#define NFILTER 20 /* The maximum number of filter layers when folding exit weights */
+#define NREFL 4096 /* The number of grazing angles in the re-weighting reflectivity table */
+#define REFL_MAX 4. /* The largest grazing angle in the re-weighting reflectivity table [critical angles] */
+#define NWAVE 64 /* The number of precomputed waviness slope fields the channels are distributed over */
+#define NWAVE_MODE 64 /* The number of spectral modes summed per waviness slope field */
+#define NWAVE_MAXPTS 16384 /* The maximum number of points along z per waviness slope field */
+#define RESP_MAGIC "PCRESP2" /* identifies transport response table files */
+#define NRESP_RING 16 /* The number of channel rings (axis offset / external radius) in a response table */
+#define NRESP_ANG 32 /* The number of incidence angles to the channel axis in a response table, spaced quadratically */
+#define NRESP_PSI 8 /* The number of incidence azimuths to the radial plane of the channel (0 - PI) in a response table */
+#define NRESP_MOM 5 /* The number of exit direction moments per response cell: r, t, r^2, t^2, r*t */
 
 // ---------------------------------------------------------------------------------------------------
 // Define structures
@@ -58,6 +109,25 @@ struct inp_file
   char ext[80];
   double n_chan;
   char out[80];
+  int n_screen; /* number of additional screen planes */
+  double d_screens[NSCREEN]; /* their distance from the polycapillary exit [cm] */
+  double z_screens[NSCREEN]; /* their position on z axis */
+  int n_sym; /* symmetric images every photon is deposited at in the spot maps (NSYM or 1) */
+  double ang_max; /* half width of the exit direction histogram [rad] */
+  struct source_model *source; /* source model, NULL for the uniform disk of radius src_x emitting isotropically */
+  int spots; /* spot maps are accumulated (no -nospot) */
+  };
+
+struct source_model
+  {
+  int type; /* SRC_DISK, SRC_GAUSS, SRC_ELLIPSE or SRC_IMAGE */
+  double a, b; /* rms widths (SRC_GAUSS) or semi-axes (SRC_ELLIPSE) along x and y, or the pixel size (SRC_IMAGE) [cm] */
+  int nx, ny; /* pixels of the image along x and y */
+  double *prob; /* alias table of the image: probability of keeping each pixel */
+  int *alias; /* pixel taken instead */
+  int n_ang; /* intervals of the angular emission profile, 0 for isotropic emission */
+  double ang_max; /* largest tabulated emission angle to the optical axis [rad] */
+  double *ang_w; /* emission weights at n_ang+1 equidistant angles from 0 to ang_max */
   };
 
 struct cap_prof_arrays
@@ -69,6 +139,20 @@ struct cap_prof_arrays
   double d_arr;
   };
 
+struct shape_func
+  {
+  int type; /* SHAPE_POLYNOMIAL, SHAPE_ELLIPSOIDAL or SHAPE_PARABOLOIDAL */
+  int n; /* polynomial degree */
+  double c[NPOLY+1]; /* polynomial coefficients, or r_max, z_centre, half length (ellipsoidal), 2*p, z_vertex (paraboloidal) */
+  };
+
+struct cap_shape
+  {
+  double length; /* capillary length [cm] */
+  struct shape_func chan; /* single capillary radius */
+  struct shape_func ext; /* external radius, the channel axes scale with it */
+  };
+
 struct cap_profile
   {
   int nmax; /*nr of points defined along capillary profile*/
@@ -77,6 +161,7 @@ struct cap_profile
   double cl;	/*capillary length*/
   double binsize; /*20.e-4 cm*/
   struct cap_prof_arrays *arr; /* will get proper size allocated to it later */
+  struct cap_shape *shape; /* parametric shape, NULL for tabulated profiles */
   };
 
 struct libraries
@@ -89,18 +174,42 @@ struct amu_cnt
   float amu;
   float cnt;
   double scatf;
+  int layer; /* spot map layer this energy is binned in, -1 if not binned */
   };
 
 struct mumc
   {
   int n_energy;
+  int n_layer; /* number of energy layers in the spot maps */
   struct amu_cnt *arr; /* Actual size defined later (n_energy+1)*float */
   };
 
+struct spot_tile
+  {
+  int tx, ty; /* tile coordinates (bin index / SPOT_TILE) */
+  double *val; /* SPOT_TILE*SPOT_TILE*nlayer values, NULL for an empty hash slot */
+  };
+
+struct spot_map
+  {
+  double binsize; /* bin width [cm] */
+  int nlayer; /* values per bin */
+  int n_tile; /* tiles in use */
+  int n_slot; /* size of hash table (power of 2) */
+  struct spot_tile *tile; /* open addressing hash table, tiles get allocated once a photon lands in them */
+  };
+
 struct leakstruct
   {
-  float spot[NSPOT][NSPOT], lspot[NSPOT][NSPOT];
-  float *leak;
+  struct spot_map *spot, *lspot; /* transmitted and leaked photon intensity on screen */
+  struct spot_map *zspot[NSCREEN], *zlspot[NSCREEN]; /* idem on the additional screen planes */
+  double *leak; /* leaked photon weight per energy */
+  int n_energy; /* highest energy index of leak and mom */
+  double binsize; /* bin width of posx and posy [cm] */
+  double ang_max; /* half width of ang [rad] */
+  double *mom; /* NSTAT_MOM weighted moments of the exit position and direction of transmitted photons, per energy */
+  double *posx, *posy; /* NSPOT bin histograms of the exit position on screen, lowest energy */
+  double *ang; /* NANG*NANG bin histogram of the exit direction, lowest energy */
   };
 
 struct ini_polycap
@@ -123,12 +232,79 @@ struct countvars
   float *w; /*actually dimension of n_energy+1*/
   };
 
+struct hist_bounce
+  {
+  float alf; /* grazing angle [rad] */
+  float desc; /* path length from reflection point to capillary exit, divided by v[2] [cm] */
+  float xp, yp; /* position on screen when leaking through the wall [cm] */
+  float dxp, dyp; /* slope of the leaking direction (v[0]/v[2], v[1]/v[2]), projects it onto the additional screens */
+  int ix; /* capillary segment of the reflection */
+  };
+
+struct telemetry
+  {
+  char filename[100]; /* snapshot file, replaced as a whole */
+  double interval; /* wall clock time between snapshots [s] */
+  double t_next; /* wall clock time of the next snapshot [s] */
+  double t_prev; /* wall clock time of the previous snapshot [s] */
+  long *prev; /* started, entered and transmitted photons per thread at the previous snapshot */
+  };
+struct chan_map
+  {
+  int n; /* amount of channel shells, indices run from -n to n */
+  int *lo; /* lowest iy index of each ix row */
+  long *off; /* map index of the first channel of each ix row, and the amount of channels after the last row */
+  long n_chan; /* amount of channels in the map */
+  int *band; /* energy band of each energy */
+  float *band_w; /* weight of each energy within its band, 1/(energies in the band) */
+  double *rec; /* NCHAN_REC accumulators per channel, in double as counts pass 2^24 */
+  };
+struct autotune
+  {
+  char filename[100]; /* cache of tuned settings */
+  char key[300]; /* machine and input the settings are tuned for */
+  int cached; /* the settings were found in the cache */
+  int n_cand, i_cand; /* amount of candidate settings and the one being measured */
+  int n_thread_cand; /* the first candidates vary the thread count, the others the chunk size */
+  int threads[NTUNE], chunk[NTUNE]; /* candidate settings */
+  long n_burst; /* photons traced per thread of a candidate */
+  int best_threads, best_chunk; /* fastest setting */
+  double best_rate; /* its photons per second */
+  };
+struct hist_file
+  {
+  FILE *fptr;
+  long off_totals; /* file position of the photon totals in the header */
+  long n_photon; /* histories written */
+  };
+
+struct zcache
+  {
+  FILE *fptr; /* cache being recorded, NULL when resuming */
+  long off_totals; /* file position of the photon totals in the header */
+  int i_plane; /* profile point the plane is at */
+  double z_plane; /* its distance from the capillary entrance [cm] */
+  int rec_size; /* size of one photon state [bytes]: rh, v, chan_x, chan_y, i_refl, w[0..n_energy] */
+  long n_state; /* photon states in the cache */
+  char *states; /* the photon states being resumed */
+  double *absorb; /* absorbed weight upstream of the plane, per profile interval */
+  };
+
+struct qmc_sampler
+  {
+  int n_rep; /* amount of independently scrambled replicates */
+  unsigned char *perm; /* digit permutations per replicate, dimension and digit */
+  int n_chan; /* amount of channels */
+  int *ix, *iy; /* channel indices */
+  double *cdf; /* cumulative selection probability of the channels */
+  };
+
 struct calcstruct
   {
   double *sx;
   double *sy;
   gsl_rng *rn;
-  float *cnt;
+  double *cnt; /* transmitted photon weight per energy */
   double *absorb;
   long i_refl;
   long istart;
@@ -141,6 +317,90 @@ struct calcstruct
   float *w;
   int iesc;
   int ix;
+  struct leakstruct *leaks; /* per-thread leak and spot accumulators */
+  double t_end; /* wall clock time at which the thread ran out of photons [s] */
+  struct hist_file *hist; /* bounce history output, NULL if not recording */
+  struct hist_bounce *bounce; /* bounces of the current photon */
+  int n_bounce, max_bounce;
+  float w_gamma; /* solid angle weight of the current photon */
+  char *hbuf; /* finished photon histories not yet written to file */
+  long n_hbuf, max_hbuf;
+  struct hist_file *exitw; /* exit weight output, NULL if not recording */
+  char *ebuf; /* exit weights of transmitted photons not yet written to file */
+  long n_ebuf;
+  double chan_x, chan_y; /* axis offset of the selected channel per unit of external radius */
+  struct qmc_sampler *qmc; /* quasi-random sampler, NULL for pseudo-random sampling */
+  double u[NQMC]; /* quasi-random point of the current photon */
+  int n_u; /* amount of coordinates of u still to be used, 0 once the first start attempt is done */
+  int qmc_rep; /* replicate of the current photon */
+  double *qcnt; /* transmitted weight per replicate and energy */
+  long *qstart; /* started photons per replicate */
+  long sum_refl; /* reflections of all photons traced by this thread */
+  long itrans; /* photons traced by this thread that reached the screen */
+  struct resp_table *resp; /* response table being recorded (own per thread) or evaluated (shared), NULL if not in use */
+  int resp_cell; /* response table cell of the current photon */
+  struct chan_map *chan_map; /* per-channel accumulators, NULL if not recording */
+  long chan; /* channel map index of the current photon */
+  struct wave_pool *wave; /* waviness slope fields, NULL for straight walls */
+  float *wave_field; /* slope field of the selected channel */
+  struct zcache *zcache; /* z-plane cache being recorded (photons stop at its plane) or resumed, NULL if not in use */
+  char *zbuf; /* photon states not yet written to the cache */
+  long n_zbuf;
+  } __attribute__((aligned(MEM_PAGE))); /* no two threads share a cache line, and each first touches its own page */
+
+struct wave_pool
+  {
+  int n_pts; /* points along z per field */
+  double dz; /* point spacing [cm] */
+  float *slope; /* NWAVE fields of n_pts (axial, azimuthal) wall slope pairs [rad] */
+  };
+
+struct resp_table
+  {
+  int n_energy; /* highest energy index */
+  double ang_max; /* largest tabulated incidence angle [rad] */
+  double *n; /* photons started per cell (ring, angle, azimuth) */
+  double *trans; /* transmitted weight per cell and energy */
+  double *mom; /* NRESP_MOM moments of the exit direction per cell, lowest energy: angles to the optical axis in
+                  the radial (r) and tangential (t) direction of the channel [rad] */
+  };
+
+struct run_opts
+  {
+  int thread_cnt; /* amount of threads, 0 means ask the user */
+  int part, n_part; /* index of this worker and total amount of workers (distributed run) */
+  int n_launch; /* amount of local worker processes to fork/exec, 0 if not a launcher */
+  int n_merge; /* amount of partial result files to merge */
+  char **merge; /* partial result file names, points into argv */
+  double spot_bin; /* spot map bin width [cm], 0 for the default */
+  double spot_size; /* width of the written spot maps [cm], 0 for the default */
+  int spot_energy; /* bin energies in separate spot map layers instead of only the lowest energy */
+  double spot_emin, spot_emax, spot_de; /* energy binning of the spot map layers [keV], spot_de 0 for every energy */
+  char *screens; /* comma separated distances of additional screen planes [cm], points into argv */
+  int chunk; /* amount of photons handed to a thread at once, 0 for a static schedule */
+  char *history; /* file to record the bounce histories in */
+  char *reweight; /* bounce history file to re-weight instead of tracing photons */
+  char *exitw; /* file to record the per-energy exit weights of transmitted photons in */
+  char *fold, *spectrum; /* exit weight file to fold with the source spectrum file instead of tracing photons */
+  char *filters; /* comma separated Z:thickness[cm] filter layers applied when folding, points into argv */
+  int hexsym; /* unfold every photon over the 12-fold symmetry of an on-axis setup in the spot maps */
+  int qmc; /* amount of scrambled quasi-random replicates, 0 for pseudo-random sampling */
+  int generic; /* trace with the generic kernel instead of the one specialised for this setup */
+  int nospot; /* do not accumulate nor write the spot maps */
+  int noxy; /* do not write the per-photon records xy.dat and xys.dat */
+  double ang_max; /* half width of the exit direction histogram [rad], 0 for the default */
+  char *response_out; /* file to record a transport response table in instead of the normal output */
+  char *response; /* response table to evaluate the source with instead of tracing photons */
+  char *compare, *compare_test; /* output directories of a reference and a test run to compare instead of tracing photons */
+  char *telemetry; /* file to write periodic run snapshots to, NULL for none */
+  char *autotune; /* cache file of autotuned thread counts and chunk sizes, NULL to not tune */
+  char *zcache_out; /* file to cache the photon states crossing a plane in instead of the normal output */
+  double zcache_z; /* distance of that plane from the capillary entrance [cm] */
+  char *zcache_in; /* z-plane cache to resume tracing the photons from instead of starting them at the source */
+  char *source, *source_p1, *source_p2; /* source model (gauss, ellipse or image) and its parameters, points into argv */
+  char *source_ang; /* angular emission profile of the source, NULL for isotropic emission */
+  int chanmap; /* accumulate and write the per-channel transmission map */
+  double telemetry_dt; /* time between the snapshots [s] */
   };
 
 // ---------------------------------------------------------------------------------------------------
@@ -158,7 +418,7 @@ struct inp_file read_cap_data(char *filename)
 		}
 
 	fscanf(fptr,"%lf",&cap.sig_rough);
-	fscanf(fptr,"%lf %lf",&cap.sig_wave, &cap.corr_length); //currently dummies
+	fscanf(fptr,"%lf %lf",&cap.sig_wave, &cap.corr_length); //rms height and correlation length of the wall waviness
 	fscanf(fptr,"%lf",&cap.d_source);
 	fscanf(fptr,"%lf",&cap.d_screen);
 	fscanf(fptr,"%lf %lf",&cap.src_x, &cap.src_y);
@@ -178,76 +438,238 @@ struct inp_file read_cap_data(char *filename)
 	fscanf(fptr,"%lf",&cap.n_chan);
 	fscanf(fptr,"%s",cap.out);
 	fclose(fptr);
+	cap.n_screen = 0;
+	cap.n_sym = 1;
+	cap.spots = 1;
+	cap.ang_max = ANG_MAX;
+	cap.source = NULL;
 
 	return cap;
 	}
 // ---------------------------------------------------------------------------------------------------
-// Read in polycapillary profile data
-struct cap_profile *read_cap_profile(struct inp_file *cap)
+// Radius of a parametric profile at distance z from the capillary entrance, and its first (dr) and
+// second (d2r) derivative
+double shape_eval(struct shape_func *f, double z, double *dr, double *d2r)
+	{
+	int i;
+	double r, t;
+
+	switch(f->type){
+		case SHAPE_ELLIPSOIDAL: //r = r_max*sqrt(1-((z-z_centre)/half_length)^2)
+			t = (z-f->c[1])/f->c[2];
+			if(t*t >= 1.){
+				*dr = 0.;
+				*d2r = 0.;
+				return 0.;
+				}
+			r = f->c[0]*sqrt(1.-t*t);
+			*dr = -1.*f->c[0]*f->c[0]*t/(f->c[2]*r);
+			*d2r = -1.*f->c[0]*f->c[0]*f->c[0]*f->c[0]/(f->c[2]*f->c[2]*r*r*r);
+			return r;
+		case SHAPE_PARABOLOIDAL: //r = sqrt(2*p*(z-z_vertex))
+			t = f->c[0]*(z-f->c[1]);
+			if(t <= 0.){
+				*dr = 0.;
+				*d2r = 0.;
+				return 0.;
+				}
+			r = sqrt(t);
+			*dr = f->c[0]/(2.*r);
+			*d2r = -1.*f->c[0]*f->c[0]/(4.*r*r*r);
+			return r;
+		default: //polynomial in z
+			r = f->c[f->n];
+			*dr = 0.;
+			*d2r = 0.;
+			for(i=f->n-1; i>=0; i--){
+				*d2r = *d2r*z + 2.* *dr;
+				*dr = *dr*z + r;
+				r = r*z + f->c[i];
+				}
+			return r;
+		}
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a parametric profile: a line 'type length parameters' with type
+//   straight r | conical r_in r_out | ellipsoidal r_max z_centre half_length |
+//   paraboloidal p z_vertex | polynomial n c0 ... cn   (lengths and radii in cm)
+// Returns 0 if the file holds a tabulated profile instead (starts with the number of intervals).
+int read_shape_func(char *filename, struct shape_func *f, double *length)
 	{
 	FILE *fptr;
-	int i, n_tmp;
+	char type[80], *end;
+	int i, n_par=0;
 
-	//single capillary profile
-	fptr = fopen(cap->prf,"r");
+	fptr = fopen(filename,"r");
 	if(fptr == NULL){
-		printf("%s file does not exist.\n",cap->prf);
+		printf("%s file does not exist.\n",filename);
 		exit(0);
 		}
-	fscanf(fptr,"%d",&n_tmp);
-
-	struct cap_profile *profile = malloc(sizeof(struct cap_profile));
-	if(profile == NULL){
-		printf("Could not allocate profile memory.\n");
+	if(fscanf(fptr,"%79s",type) != 1){
+		printf("%s file is empty.\n",filename);
 		exit(0);
 		}
-	profile->arr = malloc(sizeof(struct cap_prof_arrays)*(n_tmp+1));
-	if(profile->arr == NULL){
-		printf("Could not allocate profile->arr memory.\n");
+	strtol(type,&end,10);
+	if(*end == '\0'){ //tabulated profile
+		fclose(fptr);
+		return 0;
+		}
+	if(fscanf(fptr,"%lf",length) != 1 || *length <= 0.){
+		printf("Invalid length in parametric profile %s.\n",filename);
 		exit(0);
 		}
-	profile->nmax = n_tmp;
-	//Continue reading profile data
-	for(i=0; i<=profile->nmax; i++){
-		fscanf(fptr,"%lf %lf",&profile->arr[i].zarr,&profile->arr[i].profil);
+	f->type = SHAPE_POLYNOMIAL;
+	if(strcmp(type,"straight") == 0){
+		f->n = 0;
+		n_par = fscanf(fptr,"%lf",&f->c[0]) == 1;
+		} else if(strcmp(type,"conical") == 0){
+		f->n = 1;
+		n_par = fscanf(fptr,"%lf %lf",&f->c[0],&f->c[1]) == 2;
+		f->c[1] = (f->c[1]-f->c[0]) / *length;
+		} else if(strcmp(type,"ellipsoidal") == 0){
+		f->type = SHAPE_ELLIPSOIDAL;
+		n_par = fscanf(fptr,"%lf %lf %lf",&f->c[0],&f->c[1],&f->c[2]) == 3 && f->c[2] > 0.;
+		} else if(strcmp(type,"paraboloidal") == 0){
+		f->type = SHAPE_PARABOLOIDAL;
+		n_par = fscanf(fptr,"%lf %lf",&f->c[0],&f->c[1]) == 2;
+		f->c[0] = 2.*f->c[0];
+		} else if(strcmp(type,"polynomial") == 0){
+		n_par = fscanf(fptr,"%d",&f->n) == 1 && f->n >= 0 && f->n <= NPOLY;
+		for(i=0; n_par && i<=f->n; i++) n_par = fscanf(fptr,"%lf",&f->c[i]) == 1;
+		} else {
+		printf("Unknown parametric profile type %s in %s.\n",type,filename);
+		exit(0);
+		}
+	if(!n_par){
+		printf("Invalid parameters for %s profile in %s.\n",type,filename);
+		exit(0);
 		}
 	fclose(fptr);
-	//polycapillary central axis
-	fptr = fopen(cap->axs,"r");
-	if(fptr == NULL){
-		printf("%s file does not exist.\n",cap->axs);
+
+	return 1;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read parametric channel (*.prf) and external (*.ext) profiles, NULL if the profiles are tabulated.
+// The channel axes follow from the external profile, so no axis (*.axs) file is needed. Both profiles
+// should be in the same format.
+struct cap_shape *read_cap_shape(struct inp_file *cap)
+	{
+	struct cap_shape *shape = malloc(sizeof(struct cap_shape));
+	int chan_par, ext_par; //1 for a parametric channel or external profile
+	double length;
+
+	if(shape == NULL){
+		printf("Could not allocate shape memory.\n");
 		exit(0);
 		}
-	fscanf(fptr,"%d",&n_tmp);
-	if(profile->nmax != n_tmp){
-		printf("Inconsistent *.axs file: number of intervals different.\n");
+	chan_par = read_shape_func(cap->prf, &shape->chan, &shape->length);
+	ext_par = read_shape_func(cap->ext, &shape->ext, &length);
+	if(chan_par != ext_par){
+		printf("Profiles %s and %s should both be tabulated or both be parametric.\n",cap->prf,cap->ext);
 		exit(0);
 		}
-	for(i=0; i<=profile->nmax; i++){
-		fscanf(fptr,"%lf %lf %lf",&profile->arr[i].zarr,&profile->arr[i].sx,&profile->arr[i].sy);
+	if(chan_par == 0){
+		free(shape);
+		return NULL;
 		}
-	fclose(fptr);
-
-	//polycapillary external shape
-	fptr = fopen(cap->ext,"r");
-	if(fptr == NULL){
-		printf("%s file does not exist.\n",cap->ext);
+	if(fabs(length-shape->length) > DELTA){
+		printf("A parametric capillary profile needs a parametric external profile of the same length.\n");
 		exit(0);
 		}
-	fscanf(fptr,"%d",&n_tmp);
-	if(profile->nmax != n_tmp){
-		printf("Inconsistent *.ext file: number of intervals different.\n");
+
+	return shape;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read in polycapillary profile data
+struct cap_profile *read_cap_profile(struct inp_file *cap)
+	{
+	FILE *fptr;
+	int i, n_tmp;
+	double dr, d2r;
+
+	struct cap_profile *profile = malloc(sizeof(struct cap_profile));
+	if(profile == NULL){
+		printf("Could not allocate profile memory.\n");
 		exit(0);
 		}
-	for(i=0; i<=profile->nmax; i++){
-		fscanf(fptr,"%lf %lf",&profile->arr[i].zarr,&profile->arr[i].d_arr);
+
+	//parametric shape: sampled only for the absorption profile and entrance radii
+	profile->shape = read_cap_shape(cap);
+	if(profile->shape != NULL){
+		profile->nmax = SHAPE_NSAMPLE;
+		profile->arr = malloc(sizeof(struct cap_prof_arrays)*(profile->nmax+1));
+		if(profile->arr == NULL){
+			printf("Could not allocate profile->arr memory.\n");
+			exit(0);
+			}
+		for(i=0; i<=profile->nmax; i++){
+			profile->arr[i].zarr = profile->shape->length*i/profile->nmax;
+			profile->arr[i].profil = shape_eval(&profile->shape->chan, profile->arr[i].zarr, &dr, &d2r);
+			profile->arr[i].d_arr = shape_eval(&profile->shape->ext, profile->arr[i].zarr, &dr, &d2r);
+			profile->arr[i].sx = 0.;
+			profile->arr[i].sy = 0.;
+			}
+		profile->arr[profile->nmax].zarr = profile->shape->length;
 		}
-	fclose(fptr);
+		else
+		{
+		//single capillary profile
+		fptr = fopen(cap->prf,"r");
+		if(fptr == NULL){
+			printf("%s file does not exist.\n",cap->prf);
+			exit(0);
+			}
+		fscanf(fptr,"%d",&n_tmp);
+
+		profile->arr = malloc(sizeof(struct cap_prof_arrays)*(n_tmp+1));
+		if(profile->arr == NULL){
+			printf("Could not allocate profile->arr memory.\n");
+			exit(0);
+			}
+		profile->nmax = n_tmp;
+		//Continue reading profile data
+		for(i=0; i<=profile->nmax; i++){
+			fscanf(fptr,"%lf %lf",&profile->arr[i].zarr,&profile->arr[i].profil);
+			}
+		fclose(fptr);
+		//polycapillary central axis
+		fptr = fopen(cap->axs,"r");
+		if(fptr == NULL){
+			printf("%s file does not exist.\n",cap->axs);
+			exit(0);
+			}
+		fscanf(fptr,"%d",&n_tmp);
+		if(profile->nmax != n_tmp){
+			printf("Inconsistent *.axs file: number of intervals different.\n");
+			exit(0);
+			}
+		for(i=0; i<=profile->nmax; i++){
+			fscanf(fptr,"%lf %lf %lf",&profile->arr[i].zarr,&profile->arr[i].sx,&profile->arr[i].sy);
+			}
+		fclose(fptr);
+
+		//polycapillary external shape
+		fptr = fopen(cap->ext,"r");
+		if(fptr == NULL){
+			printf("%s file does not exist.\n",cap->ext);
+			exit(0);
+			}
+		fscanf(fptr,"%d",&n_tmp);
+		if(profile->nmax != n_tmp){
+			printf("Inconsistent *.ext file: number of intervals different.\n");
+			exit(0);
+			}
+		for(i=0; i<=profile->nmax; i++){
+			fscanf(fptr,"%lf %lf",&profile->arr[i].zarr,&profile->arr[i].d_arr);
+			}
+		fclose(fptr);
+		} //if(profile->shape != NULL) ... else ...
 
 	profile->rtot1 = profile->arr[0].d_arr;
 	profile->rtot2 = profile->arr[profile->nmax].d_arr;
 	profile->cl = profile->arr[profile->nmax].zarr;
 	cap->d_screen = cap->d_screen + cap->d_source + profile->cl; //position of screen on z axis
+	for(i=0; i<cap->n_screen; i++) cap->z_screens[i] = cap->d_screens[i] + cap->d_source + profile->cl;
 	profile->binsize = 20.e-4; 
 
 	return profile;
@@ -273,6 +695,278 @@ struct libraries read_library_files(struct inp_file *cap)
 	return lib;
 	}
 // ---------------------------------------------------------------------------------------------------
+// Read in the optional command line arguments following the input file
+struct run_opts read_run_opts(int argc, char *argv[])
+	{
+	int i;
+	struct run_opts opts;
+
+	opts.thread_cnt = 0;
+	opts.part = 0;
+	opts.n_part = 1;
+	opts.n_launch = 0;
+	opts.n_merge = 0;
+	opts.merge = NULL;
+	opts.spot_bin = 0.;
+	opts.spot_size = 0.;
+	opts.spot_energy = 0;
+	opts.spot_emin = 0.;
+	opts.spot_emax = 0.;
+	opts.spot_de = 0.;
+	opts.screens = NULL;
+	opts.chunk = 16;
+	opts.history = NULL;
+	opts.reweight = NULL;
+	opts.exitw = NULL;
+	opts.fold = NULL;
+	opts.spectrum = NULL;
+	opts.filters = NULL;
+	opts.hexsym = 0;
+	opts.qmc = 0;
+	opts.generic = 0;
+	opts.nospot = 0;
+	opts.noxy = 0;
+	opts.ang_max = 0.;
+	opts.response_out = NULL;
+	opts.response = NULL;
+	opts.compare = NULL;
+	opts.compare_test = NULL;
+	opts.telemetry = NULL;
+	opts.autotune = NULL;
+	opts.zcache_out = NULL;
+	opts.zcache_z = 0.;
+	opts.zcache_in = NULL;
+	opts.source = NULL;
+	opts.source_p1 = NULL;
+	opts.source_p2 = NULL;
+	opts.source_ang = NULL;
+	opts.chanmap = 0;
+	opts.telemetry_dt = 0.;
+
+	for(i=2; i<argc; i++){
+		if(strcmp(argv[i],"-threads") == 0 && i+1 < argc){
+			opts.thread_cnt = atoi(argv[++i]);
+			} else if(strcmp(argv[i],"-part") == 0 && i+2 < argc){
+			opts.part = atoi(argv[++i]);
+			opts.n_part = atoi(argv[++i]);
+			} else if(strcmp(argv[i],"-launch") == 0 && i+1 < argc){
+			opts.n_launch = atoi(argv[++i]);
+			} else if(strcmp(argv[i],"-spot_bin") == 0 && i+1 < argc){
+			opts.spot_bin = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-spot_size") == 0 && i+1 < argc){
+			opts.spot_size = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-spot_energy") == 0){
+			opts.spot_energy = 1;
+			} else if(strcmp(argv[i],"-spot_ebin") == 0 && i+3 < argc){
+			opts.spot_energy = 1;
+			opts.spot_emin = atof(argv[++i]);
+			opts.spot_emax = atof(argv[++i]);
+			opts.spot_de = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-chunk") == 0 && i+1 < argc){
+			opts.chunk = atoi(argv[++i]);
+			} else if(strcmp(argv[i],"-history") == 0 && i+1 < argc){
+			opts.history = argv[++i];
+			} else if(strcmp(argv[i],"-reweight") == 0 && i+1 < argc){
+			opts.reweight = argv[++i];
+			} else if(strcmp(argv[i],"-exitw") == 0 && i+1 < argc){
+			opts.exitw = argv[++i];
+			} else if(strcmp(argv[i],"-fold") == 0 && i+2 < argc){
+			opts.fold = argv[++i];
+			opts.spectrum = argv[++i];
+			} else if(strcmp(argv[i],"-filter") == 0 && i+1 < argc){
+			opts.filters = argv[++i];
+			} else if(strcmp(argv[i],"-qmc") == 0 && i+1 < argc){
+			opts.qmc = atoi(argv[++i]);
+			} else if(strcmp(argv[i],"-hexsym") == 0){
+			opts.hexsym = 1;
+			} else if(strcmp(argv[i],"-generic") == 0){
+			opts.generic = 1;
+			} else if(strcmp(argv[i],"-nospot") == 0){
+			opts.nospot = 1;
+			} else if(strcmp(argv[i],"-noxy") == 0){
+			opts.noxy = 1;
+			} else if(strcmp(argv[i],"-ang_max") == 0 && i+1 < argc){
+			opts.ang_max = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-response_out") == 0 && i+1 < argc){
+			opts.response_out = argv[++i];
+			} else if(strcmp(argv[i],"-response") == 0 && i+1 < argc){
+			opts.response = argv[++i];
+			} else if(strcmp(argv[i],"-compare") == 0 && i+2 < argc){
+			opts.compare = argv[++i];
+			opts.compare_test = argv[++i];
+			} else if(strcmp(argv[i],"-telemetry") == 0 && i+2 < argc){
+			opts.telemetry = argv[++i];
+			opts.telemetry_dt = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-chanmap") == 0){
+			opts.chanmap = 1;
+			} else if(strcmp(argv[i],"-autotune") == 0 && i+1 < argc){
+			opts.autotune = argv[++i];
+			} else if(strcmp(argv[i],"-zcache_out") == 0 && i+2 < argc){
+			opts.zcache_out = argv[++i];
+			opts.zcache_z = atof(argv[++i]);
+			} else if(strcmp(argv[i],"-zcache_in") == 0 && i+1 < argc){
+			opts.zcache_in = argv[++i];
+			} else if(strcmp(argv[i],"-source") == 0 && i+3 < argc){
+			opts.source = argv[++i];
+			opts.source_p1 = argv[++i];
+			opts.source_p2 = argv[++i];
+			} else if(strcmp(argv[i],"-source_ang") == 0 && i+1 < argc){
+			opts.source_ang = argv[++i];
+			} else if(strcmp(argv[i],"-screens") == 0 && i+1 < argc){
+			opts.screens = argv[++i];
+			} else if(strcmp(argv[i],"-merge") == 0 && i+1 < argc){
+			//all remaining arguments are partial result files
+			opts.merge = &argv[i+1];
+			opts.n_merge = argc-i-1;
+			break;
+			} else {
+			printf("Unknown or incomplete option: %s\n",argv[i]);
+			exit(0);
+			}
+		}
+	if(opts.n_part < 1 || opts.part < 0 || opts.part >= opts.n_part){
+		printf("Invalid worker index %d of %d workers.\n",opts.part,opts.n_part);
+		exit(0);
+		}
+	if(opts.spot_bin < 0. || opts.spot_size < 0.){
+		printf("Spot bin width and size should be positive.\n");
+		exit(0);
+		}
+	if(opts.ang_max < 0.){
+		printf("Exit direction histogram width should be positive.\n");
+		exit(0);
+		}
+	if(opts.qmc < 0 || opts.qmc == 1){
+		printf("At least 2 quasi-random replicates are needed for an error estimate.\n");
+		exit(0);
+		}
+	if(opts.chanmap && (opts.n_part > 1 || opts.n_launch > 0 || opts.response_out != NULL || opts.response != NULL)){
+		printf("-chanmap can not be combined with -part, -launch, -response_out or -response.\n");
+		exit(0);
+		}
+	if(opts.autotune != NULL && opts.n_launch > 0){
+		printf("-autotune can not be combined with -launch.\n");
+		exit(0);
+		}
+	if(opts.telemetry != NULL && opts.telemetry_dt <= 0.){
+		printf("Telemetry interval should be positive.\n");
+		exit(0);
+		}
+	if(opts.chunk < 0){
+		printf("Chunk size should be positive.\n");
+		exit(0);
+		}
+	if(opts.spot_de < 0. || opts.spot_emax < opts.spot_emin){
+		printf("Invalid spot energy binning %f - %f keV per %f keV.\n",opts.spot_emin,opts.spot_emax,opts.spot_de);
+		exit(0);
+		}
+	if(opts.n_launch < 0 || (opts.n_launch > 0 && opts.n_part > 1)){
+		printf("-launch can not be combined with -part.\n");
+		exit(0);
+		}
+	if((opts.history != NULL || opts.exitw != NULL) && (opts.n_launch > 0 || opts.n_merge > 0)){
+		printf("-history and -exitw can not be combined with -launch or -merge, trace each -part instead.\n");
+		exit(0);
+		}
+	if(opts.response_out != NULL && (opts.n_part > 1 || opts.n_launch > 0 || opts.n_merge > 0 || opts.response != NULL)){
+		printf("-response_out can not be combined with -part, -launch, -merge or -response.\n");
+		exit(0);
+		}
+	if((opts.zcache_out != NULL || opts.zcache_in != NULL) && (opts.n_part > 1 || opts.n_launch > 0 || opts.n_merge > 0 ||
+	   opts.history != NULL || opts.qmc > 0 || opts.chanmap || opts.response_out != NULL || opts.response != NULL)){
+		printf("-zcache_out and -zcache_in can not be combined with -part, -launch, -merge, -history, -qmc, -chanmap, -response_out or -response.\n");
+		exit(0);
+		}
+	if(opts.zcache_out != NULL && (opts.zcache_in != NULL || opts.exitw != NULL)){
+		printf("-zcache_out can not be combined with -zcache_in or -exitw.\n");
+		exit(0);
+		}
+
+	return opts;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Store the additional screen distances given as comma separated list in cap
+void read_screens(char *screens, struct inp_file *cap)
+	{
+	char *str, *end;
+
+	cap->n_screen = 0;
+	if(screens == NULL) return;
+	str = screens;
+	while(*str != '\0'){
+		if(cap->n_screen >= NSCREEN){
+			printf("At most %d additional screens can be used.\n",NSCREEN);
+			exit(0);
+			}
+		cap->d_screens[cap->n_screen] = strtod(str,&end);
+		if(end == str || (*end != ',' && *end != '\0')){
+			printf("Invalid screen distance list: %s\n",screens);
+			exit(0);
+			}
+		cap->n_screen++;
+		str = (*end == ',') ? end+1 : end;
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// With the source on axis and photons aimed uniformly at the channel entrances, the hexagonal channel
+// lattice, the round source and the hexagonal housing are invariant under the 6 rotations by 60 degrees
+// and 6 mirrors. Every photon is then equally likely as its 12 symmetric images, so depositing it at
+// all of them with 1/12 of the weight gives the same expectation for much less noise in the spot maps.
+// This also needs a straight capillary axis and walls without waviness.
+void ini_hexsym(struct inp_file *cap, struct cap_profile *profile, struct run_opts *opts)
+	{
+	int i;
+
+	cap->n_sym = 1;
+	if(opts->hexsym == 0) return;
+	if(fabs(cap->src_shiftx) > DELTA || fabs(cap->src_shifty) > DELTA || cap->src_sigx*cap->src_sigy >= 1.e-20){
+		printf("Warning: -hexsym needs an on-axis source aimed uniformly at the channels, ignored.\n");
+		return;
+		}
+	if(opts->source != NULL && (strcmp(opts->source,"image") == 0 || atof(opts->source_p1) != atof(opts->source_p2))){
+		printf("Warning: -hexsym needs a round source, ignored.\n");
+		return;
+		}
+	for(i=0; i<=profile->nmax; i++){
+		if(fabs(profile->arr[i].sx) > DELTA || fabs(profile->arr[i].sy) > DELTA){
+			printf("Warning: -hexsym needs a straight capillary axis, %s is not, ignored.\n",cap->axs);
+			return;
+			}
+		}
+	if(cap->sig_wave > 0.){
+		printf("Warning: -hexsym needs walls without waviness, ignored.\n");
+		return;
+		}
+	cap->n_sym = NSYM;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Derive the seed of one worker of a distributed run from the common seed in random.dat,
+// so each worker traces its photons with an independent rng stream
+double part_seed(double rseed, int part)
+	{
+	int i;
+	double new_seed;
+	gsl_rng *rn = gsl_rng_alloc(gsl_rng_mt19937);
+
+	gsl_rng_set(rn,rseed);
+	new_seed = rseed;
+	for(i=0; i<part; i++) new_seed = gsl_rng_uniform_pos(rn)*2147483647.;
+	gsl_rng_free(rn);
+
+	return new_seed;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Seed of the rng stream of photon icount, so a photon is traced the same whichever thread traces it.
+// Distinct for up to 2^32 photons, the seed range of mt19937.
+unsigned long photon_seed(double rseed, long icount)
+	{
+	return ((unsigned long)rseed + 2654435761UL*(unsigned long)icount) & 0xffffffffUL;
+	}
+// ---------------------------------------------------------------------------------------------------
 // Calculate total cross sections and scatter factor
 struct mumc *ini_mumc(struct inp_file *cap)
 	{
@@ -306,89 +1000,367 @@ struct mumc *ini_mumc(struct inp_file *cap)
 		absmu->arr[i].amu = totmu * cap->density;
 
 		absmu->arr[i].scatf = scatf;
+		absmu->arr[i].layer = -1;
 		}
+	//by default only the lowest energy is binned in the spot maps
+	absmu->arr[0].layer = 0;
+	absmu->n_layer = 1;
 
 	return absmu;
 	}
 // ---------------------------------------------------------------------------------------------------
-struct leakstruct *reset_leak(struct cap_profile *profile,struct mumc *absmu)
+// Assign the energies to spot map layers: every energy its own layer (spot_de == 0), or all energies
+// within the same [spot_emin + k*spot_de, spot_emin + (k+1)*spot_de) band summed into layer k
+void ini_spot_layers(struct inp_file *cap, struct mumc *absmu, struct run_opts *opts)
 	{
-	int i, j;
-	struct leakstruct *leaks=malloc(sizeof(struct leakstruct));
-	if(leaks == NULL){
-		printf("Could not allocate leaks memory.\n");
+	int i;
+	float e;
+
+	if(opts->spot_energy == 0) return;
+	if(opts->spot_de <= 0.){
+		for(i=0; i<=absmu->n_energy; i++) absmu->arr[i].layer = i;
+		absmu->n_layer = absmu->n_energy+1;
+		return;
+		}
+	absmu->n_layer = (int)ceil((opts->spot_emax - opts->spot_emin)/opts->spot_de);
+	if(absmu->n_layer < 1) absmu->n_layer = 1;
+	for(i=0; i<=absmu->n_energy; i++){
+		e = cap->e_start + i*cap->delta_e;
+		absmu->arr[i].layer = (int)floor((e - opts->spot_emin)/opts->spot_de + 1.e-6);
+		if(e < opts->spot_emin - 1.e-6 || absmu->arr[i].layer >= absmu->n_layer) absmu->arr[i].layer = -1;
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Spot maps are sparse: only the tiles of SPOT_TILE*SPOT_TILE bins that are hit get allocated,
+// stored in a hash table on tile coordinates that grows on demand, so there is no fixed extent.
+struct spot_map *spot_alloc(double binsize, int nlayer)
+	{
+	int i;
+	struct spot_map *map = malloc(sizeof(struct spot_map));
+	if(map == NULL){
+		printf("Could not allocate spot map memory.\n");
 		exit(0);
 		}
-	leaks->leak = malloc(sizeof(leaks->leak)*(profile->nmax+1));
-	if(leaks->leak == NULL){
-		printf("Could not allocate leaks->leak memory.\n");
+	map->binsize = binsize;
+	map->nlayer = nlayer;
+	map->n_tile = 0;
+	map->n_slot = 64;
+	map->tile = malloc(sizeof(struct spot_tile)*map->n_slot);
+	if(map->tile == NULL){
+		printf("Could not allocate spot map tile memory.\n");
 		exit(0);
 		}
+	for(i=0; i<map->n_slot; i++) map->tile[i].val = NULL;
 
-	for(i=0; i<=profile->nmax; i++) leaks->leak[i] = (float)0.;
-	for(i=0; i<NSPOT; i++){
-		for(j=0; j<NSPOT; j++){
-			leaks->spot[i][j] = (float)0.;
-			leaks->lspot[i][j] = (float)0.;
-			}
-		}
-	for(i=0; i<=absmu->n_energy; i++) absmu->arr[i].cnt = (float)0.;
+	return map;
+	}
+// ---------------------------------------------------------------------------------------------------
+void spot_free(struct spot_map *map)
+	{
+	int i;
 
-	return leaks;
+	for(i=0; i<map->n_slot; i++) if(map->tile[i].val != NULL) free(map->tile[i].val);
+	free(map->tile);
+	free(map);
+
+	return;
 	}
 // ---------------------------------------------------------------------------------------------------
-struct ini_polycap ini_polycap(struct inp_file *cap, struct cap_profile *profile)
+// Find the tile with coordinates tx, ty; allocate it if create != 0, else return NULL if absent
+double *spot_tile(struct spot_map *map, int tx, int ty, int create)
 	{
-	double chan_rad, s_unit;
-	struct ini_polycap pcap_ini;
+	int i, j, n_old;
+	unsigned int h;
+	struct spot_tile *old;
 
-	chan_rad = profile->arr[0].profil; //entrance radius of single capillary
-	pcap_ini.eta = chan_rad / profile->rtot1; //devide by external PC entrance radius
-	pcap_ini.eta = pcap_ini.eta * pcap_ini.eta * cap->n_chan; //polycapillary open area (assuming circle)
-	pcap_ini.n_chan_max = sqrt(12. * cap->n_chan - 3.)/6.-0.5; //amount of 'shells' in hexagon PC
-	if(pcap_ini.n_chan_max <= 0){
-		printf("N_CHANNEL must be >=7\n");
+	h = ((unsigned int)tx*73856093u) ^ ((unsigned int)ty*19349663u);
+	for(i = h & (map->n_slot-1); map->tile[i].val != NULL; i = (i+1) & (map->n_slot-1)){
+		if(map->tile[i].tx == tx && map->tile[i].ty == ty) return map->tile[i].val;
+		}
+	if(create == 0) return NULL;
+
+	if(2*(map->n_tile+1) > map->n_slot){ //keep hash table at most half full
+		old = map->tile;
+		n_old = map->n_slot;
+		map->n_slot = 2*n_old;
+		map->tile = malloc(sizeof(struct spot_tile)*map->n_slot);
+		if(map->tile == NULL){
+			printf("Could not allocate spot map tile memory.\n");
+			exit(0);
+			}
+		for(i=0; i<map->n_slot; i++) map->tile[i].val = NULL;
+		for(j=0; j<n_old; j++){
+			if(old[j].val == NULL) continue;
+			h = ((unsigned int)old[j].tx*73856093u) ^ ((unsigned int)old[j].ty*19349663u);
+			for(i = h & (map->n_slot-1); map->tile[i].val != NULL; i = (i+1) & (map->n_slot-1));
+			map->tile[i] = old[j];
+			}
+		free(old);
+		h = ((unsigned int)tx*73856093u) ^ ((unsigned int)ty*19349663u);
+		for(i = h & (map->n_slot-1); map->tile[i].val != NULL; i = (i+1) & (map->n_slot-1));
+		}
+	map->tile[i].tx = tx;
+	map->tile[i].ty = ty;
+	map->tile[i].val = calloc(SPOT_TILE*SPOT_TILE*map->nlayer,sizeof(double));
+	if(map->tile[i].val == NULL){
+		printf("Could not allocate spot map tile memory.\n");
 		exit(0);
 		}
-	s_unit = profile->rtot1/(pcap_ini.n_chan_max); //width of a single shell
-	pcap_ini.cap_unita[0] = s_unit;
-	pcap_ini.cap_unita[1] = 0.;
-	pcap_ini.cap_unitb[0] = s_unit * cos(PI/3.);
-	pcap_ini.cap_unitb[1] = s_unit * sin(PI/3.);
+	map->n_tile++;
 
-	return pcap_ini;
+	return map->tile[i].val;
 	}
 // ---------------------------------------------------------------------------------------------------
-void norm(double *vect, int ndim)
+// Values (one per layer) of the bin containing screen position (x,y), NULL if far outside any grid
+double *spot_bin(struct spot_map *map, double x, double y)
 	{
-	int i;
-	double sum=0;
+	double fx, fy;
+	int ind_x, ind_y, tx, ty;
+	double *val;
 
-	for(i=0;i<ndim;i++) sum = sum+ (*(vect+i)) * (*(vect+i));
-	sum = sqrt(sum);
+	fx = floor(x/map->binsize);
+	fy = floor(y/map->binsize);
+	if(fabs(fx) > INT_MAX/2 || fabs(fy) > INT_MAX/2) return NULL; //photon (nearly) parallel to screen
+	ind_x = (int)fx;
+	ind_y = (int)fy;
+	tx = (int)floor((double)ind_x/SPOT_TILE);
+	ty = (int)floor((double)ind_y/SPOT_TILE);
+	val = spot_tile(map, tx, ty, 1);
 
-	for(i=0;i<ndim;i++) *(vect+i) /= sum;
+	return &val[((ind_y-ty*SPOT_TILE)*SPOT_TILE + ind_x-tx*SPOT_TILE)*map->nlayer];
+	}
+// ---------------------------------------------------------------------------------------------------
+// Look up the spot bins of the n_sym symmetric images of point (x,y): the rotations over multiples
+// of 60 degrees of the point and of its mirror image in the x axis (n_sym 1 only gives the point itself)
+void spot_bin_images(struct spot_map *map, double x, double y, int n_sym, double **bins)
+	{
+	int k;
+	double phi, ys;
+
+	bins[0] = spot_bin(map, x, y);
+	for(k=1; k<n_sym; k++){
+		phi = PI/3.*(k/2);
+		ys = (k%2 == 1) ? -y : y;
+		bins[k] = spot_bin(map, x*cos(phi)-ys*sin(phi), x*sin(phi)+ys*cos(phi));
+		}
 
 	return;
 	}
 // ---------------------------------------------------------------------------------------------------
-double scalar(double vect0[3],double vect1[3])
+// Add weight w to the bin containing screen position (x,y) in the given layer
+void spot_add(struct spot_map *map, double x, double y, int layer, double w)
 	{
-	int i;
-	double sum=0;
+	double *val = spot_bin(map, x, y);
 
-	for(i=0; i<3; i++) sum = sum + vect0[i]*vect1[i];
+	if(val != NULL) val[layer] += w;
 
-	return sum;
+	return;
 	}
 // ---------------------------------------------------------------------------------------------------
-// calculates the intersection point coordinates of the photon trajectory and a given linear segment of the capillary wall
-int segment(double s0[3], double s1[3], double rad0, double rad1, double rh1[3], double v[3], double rn[3], double *calf)
+// Value of bin (ind_x, ind_y) in the given layer
+double spot_get(struct spot_map *map, int ind_x, int ind_y, int layer)
 	{
-	int iesc_local = 0;
-	double drs[3], ds[3]; //coordinates of previous photon interaction and current point capillary axis, with previous point capillary axis set as origin [0,0,0]
-	double vds; //cosine of angle between vectors v and ds (photon propagation and capillary wall segment)
-	double a, b;
+	int tx, ty;
+	double *val;
+
+	tx = (int)floor((double)ind_x/SPOT_TILE);
+	ty = (int)floor((double)ind_y/SPOT_TILE);
+	val = spot_tile(map, tx, ty, 0);
+	if(val == NULL) return 0.;
+
+	return val[((ind_y-ty*SPOT_TILE)*SPOT_TILE + ind_x-tx*SPOT_TILE)*map->nlayer + layer];
+	}
+// ---------------------------------------------------------------------------------------------------
+// Add all tiles of map src to map dst (reduction of the per-thread spot maps)
+void spot_merge(struct spot_map *dst, struct spot_map *src)
+	{
+	int i, j;
+	double *val;
+
+	for(i=0; i<src->n_slot; i++){
+		if(src->tile[i].val == NULL) continue;
+		val = spot_tile(dst, src->tile[i].tx, src->tile[i].ty, 1);
+		for(j=0; j<SPOT_TILE*SPOT_TILE*dst->nlayer; j++) val[j] += src->tile[i].val[j];
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+struct leakstruct *reset_leak(struct inp_file *cap, struct cap_profile *profile,struct mumc *absmu)
+	{
+	int i;
+	struct leakstruct *leaks=malloc(sizeof(struct leakstruct));
+	if(leaks == NULL){
+		printf("Could not allocate leaks memory.\n");
+		exit(0);
+		}
+	leaks->leak = malloc(sizeof(*leaks->leak)*(absmu->n_energy+1));
+	if(leaks->leak == NULL){
+		printf("Could not allocate leaks->leak memory.\n");
+		exit(0);
+		}
+
+	for(i=0; i<=absmu->n_energy; i++) leaks->leak[i] = 0.;
+	leaks->n_energy = absmu->n_energy;
+	leaks->binsize = profile->binsize;
+	leaks->ang_max = cap->ang_max;
+	leaks->mom = calloc(NSTAT_MOM*(absmu->n_energy+1),sizeof(double));
+	leaks->posx = calloc(NSPOT,sizeof(double));
+	leaks->posy = calloc(NSPOT,sizeof(double));
+	leaks->ang = calloc(NANG*NANG,sizeof(double));
+	if(leaks->mom == NULL || leaks->posx == NULL || leaks->posy == NULL || leaks->ang == NULL){
+		printf("Could not allocate leaks exit statistics memory.\n");
+		exit(0);
+		}
+	leaks->spot = spot_alloc(profile->binsize, absmu->n_layer);
+	leaks->lspot = spot_alloc(profile->binsize, absmu->n_layer);
+	for(i=0; i<cap->n_screen; i++){
+		leaks->zspot[i] = spot_alloc(profile->binsize, absmu->n_layer);
+		leaks->zlspot[i] = spot_alloc(profile->binsize, absmu->n_layer);
+		}
+	for(i=0; i<=absmu->n_energy; i++) absmu->arr[i].cnt = (float)0.;
+
+	return leaks;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Allocate the per-thread state of thread_cnt threads, page aligned. It is left untouched here, so
+// each page gets placed on the NUMA node of the thread initialising its calc[] entry.
+struct calcstruct *alloc_calc(int thread_cnt)
+	{
+	void *calc;
+
+	if(posix_memalign(&calc, MEM_PAGE, sizeof(struct calcstruct)*thread_cnt) != 0){
+		printf("Could not allocate calc memory.\n");
+		exit(0);
+		}
+
+	return calc;
+	}
+// ---------------------------------------------------------------------------------------------------
+void free_leak(struct inp_file *cap, struct leakstruct *leaks)
+	{
+	int i;
+
+	spot_free(leaks->spot);
+	spot_free(leaks->lspot);
+	for(i=0; i<cap->n_screen; i++){
+		spot_free(leaks->zspot[i]);
+		spot_free(leaks->zlspot[i]);
+		}
+	free(leaks->leak);
+	free(leaks->mom);
+	free(leaks->posx);
+	free(leaks->posy);
+	free(leaks->ang);
+	free(leaks);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Add a transmitted photon with weights w[0..n_energy], position (xp,yp) on screen and direction v
+// to the exit moments and, for the lowest energy, the position and direction histograms
+void stats_add(struct leakstruct *leaks, int n_energy, double xp, double yp, double *v, float *w)
+	{
+	int i, ix, iy;
+	double dx, dy; //direction angles to the optical axis [rad]
+	double *mom;
+
+	dx = v[0]/v[2];
+	dy = v[1]/v[2];
+	for(i=0; i<=n_energy; i++){
+		mom = &leaks->mom[i*NSTAT_MOM];
+		mom[0] += w[i];
+		mom[1] += w[i]*xp;
+		mom[2] += w[i]*yp;
+		mom[3] += w[i]*xp*xp;
+		mom[4] += w[i]*yp*yp;
+		mom[5] += w[i]*dx;
+		mom[6] += w[i]*dy;
+		mom[7] += w[i]*dx*dx;
+		mom[8] += w[i]*dy*dy;
+		}
+	ix = (int)floor(xp/leaks->binsize) + NSPOT/2;
+	iy = (int)floor(yp/leaks->binsize) + NSPOT/2;
+	if(fabs(xp/leaks->binsize) < NSPOT/2) leaks->posx[ix] += w[0];
+	if(fabs(yp/leaks->binsize) < NSPOT/2) leaks->posy[iy] += w[0];
+	if(fabs(dx) < leaks->ang_max && fabs(dy) < leaks->ang_max){
+		ix = (int)((dx+leaks->ang_max)/(2.*leaks->ang_max)*NANG);
+		iy = (int)((dy+leaks->ang_max)/(2.*leaks->ang_max)*NANG);
+		if(ix < NANG && iy < NANG) leaks->ang[iy*NANG+ix] += w[0];
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Add the exit moments and histograms of src to those of dst
+void stats_merge(struct leakstruct *dst, struct leakstruct *src)
+	{
+	int i;
+
+	for(i=0; i<NSTAT_MOM*(dst->n_energy+1); i++) dst->mom[i] += src->mom[i];
+	for(i=0; i<NSPOT; i++){
+		dst->posx[i] += src->posx[i];
+		dst->posy[i] += src->posy[i];
+		}
+	for(i=0; i<NANG*NANG; i++) dst->ang[i] += src->ang[i];
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+struct ini_polycap ini_polycap(struct inp_file *cap, struct cap_profile *profile)
+	{
+	double chan_rad, s_unit;
+	struct ini_polycap pcap_ini;
+
+	chan_rad = profile->arr[0].profil; //entrance radius of single capillary
+	pcap_ini.eta = chan_rad / profile->rtot1; //devide by external PC entrance radius
+	pcap_ini.eta = pcap_ini.eta * pcap_ini.eta * cap->n_chan; //polycapillary open area (assuming circle)
+	pcap_ini.n_chan_max = sqrt(12. * cap->n_chan - 3.)/6.-0.5; //amount of 'shells' in hexagon PC
+	if(pcap_ini.n_chan_max <= 0){
+		printf("N_CHANNEL must be >=7\n");
+		exit(0);
+		}
+	s_unit = profile->rtot1/(pcap_ini.n_chan_max); //width of a single shell
+	pcap_ini.cap_unita[0] = s_unit;
+	pcap_ini.cap_unita[1] = 0.;
+	pcap_ini.cap_unitb[0] = s_unit * cos(PI/3.);
+	pcap_ini.cap_unitb[1] = s_unit * sin(PI/3.);
+
+	return pcap_ini;
+	}
+// ---------------------------------------------------------------------------------------------------
+void norm(double *vect, int ndim)
+	{
+	int i;
+	double sum=0;
+
+	for(i=0;i<ndim;i++) sum = sum+ (*(vect+i)) * (*(vect+i));
+	sum = sqrt(sum);
+
+	for(i=0;i<ndim;i++) *(vect+i) /= sum;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+double scalar(double vect0[3],double vect1[3])
+	{
+	int i;
+	double sum=0;
+
+	for(i=0; i<3; i++) sum = sum + vect0[i]*vect1[i];
+
+	return sum;
+	}
+// ---------------------------------------------------------------------------------------------------
+// calculates the intersection point coordinates of the photon trajectory and a given linear segment of the capillary wall
+int segment(double s0[3], double s1[3], double rad0, double rad1, double rh1[3], double v[3], double rn[3], double *calf)
+	{
+	int iesc_local = 0;
+	double drs[3], ds[3]; //coordinates of previous photon interaction and current point capillary axis, with previous point capillary axis set as origin [0,0,0]
+	double vds; //cosine of angle between vectors v and ds (photon propagation and capillary wall segment)
+	double a, b;
 	double aa[3], bb[3];
 	double a0, b0, c0;
 	double disc, ck1, ck2; //discriminant (disc) and solutions (ck1 and ck2) of quadratic equation
@@ -496,131 +1468,876 @@ int segment(double s0[3], double s1[3], double rad0, double rad1, double rh1[3],
 	return iesc_local;
 	}
 // ---------------------------------------------------------------------------------------------------
-int reflect(double alf, struct inp_file *cap, struct mumc *absmu, struct cap_profile *profile, struct leakstruct *leaks, struct calcstruct *calc, int *thread_id)
+// Distance function of a parametric channel with axis ext(z)*(chan_x,chan_y) and radius chan(z) along the
+// photon path rh0 + t*v: f = |photon - axis|^2 - radius^2 (negative inside the channel), its first (df)
+// and second (d2f) derivative to t. u returns the photon position relative to the axis.
+double shape_dist(struct cap_shape *shape, double chan_x, double chan_y, double rh0[3], double v[3], double t, double *df, double *d2f, double u[2])
+	{
+	double z, e, de, d2e, r, dr, d2r, w[2];
+
+	z = rh0[2] + t*v[2];
+	e = shape_eval(&shape->ext, z, &de, &d2e);
+	r = shape_eval(&shape->chan, z, &dr, &d2r);
+	u[0] = rh0[0] + t*v[0] - chan_x*e;
+	u[1] = rh0[1] + t*v[1] - chan_y*e;
+	w[0] = v[0] - v[2]*de*chan_x; //du/dt
+	w[1] = v[1] - v[2]*de*chan_y;
+	*df = 2.*(u[0]*w[0] + u[1]*w[1] - r*dr*v[2]);
+	*d2f = 2.*(w[0]*w[0] + w[1]*w[1] - v[2]*v[2]*d2e*(u[0]*chan_x + u[1]*chan_y) - v[2]*v[2]*(dr*dr + r*d2r));
+
+	return u[0]*u[0] + u[1]*u[1] - r*r;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Next wall intersection of a photon at rh1 (z relative to capillary entrance) with direction v in a
+// parametric channel. The path is followed in steps to the root of the local quadratic model of the
+// distance function (exact for straight and conical channels), at most 1/SHAPE_NSTEP of the capillary
+// long, until the wall is crossed; the crossing is then solved with bracketed Newton iterations.
+// Returns 0 and updates rh1, rn and calf as segment() does, or -2 if the photon leaves the capillary.
+int shape_intersect(struct cap_shape *shape, double chan_x, double chan_y, double rh1[3], double v[3], double rn[3], double *calf)
+	{
+	int it;
+	double rh0[3]; //photon position before the intersection
+	double t, t1=0., t_end, t_max, ds, disc, s1, s2, t_lo, t_hi;
+	double f, df, d2f, f1=-1., df1=0., d2f1, u[2];
+	double e, de, d2e, r, dr, d2r;
+
+	//as with tabulated profiles, photons travelling back to the source are not followed
+	if(v[2] <= EPSILON) return -2;
+	rh0[0] = rh1[0];
+	rh0[1] = rh1[1];
+	rh0[2] = rh1[2];
+	t_end = (shape->length - rh0[2])/v[2];
+	t_max = shape->length/SHAPE_NSTEP/v[2];
+	t = 0.;
+	f = shape_dist(shape, chan_x, chan_y, rh0, v, t, &df, &d2f, u);
+	while(t < t_end){
+		//smallest step ahead to a root of f + df*s + d2f/2*s^2
+		ds = t_max;
+		if(fabs(d2f) > EPSILON){
+			disc = df*df - 2.*d2f*f;
+			if(disc >= 0.){
+				disc = sqrt(disc);
+				s1 = (-df - disc)/d2f;
+				s2 = (-df + disc)/d2f;
+				if(s1 > s2){
+					disc = s1;
+					s1 = s2;
+					s2 = disc;
+					}
+				if(s1 > 1.e-10) ds = s1;
+					else if(s2 > 1.e-10) ds = s2;
+				}
+			} else if(df > EPSILON && -f/df > 1.e-10) ds = -f/df;
+		if(ds > t_max) ds = t_max;
+		t1 = t + ds;
+		if(t1 > t_end) t1 = t_end;
+		f1 = shape_dist(shape, chan_x, chan_y, rh0, v, t1, &df1, &d2f1, u);
+		if(f1 >= 0.) break; //wall crossed between t and t1
+		t = t1;
+		f = f1;
+		df = df1;
+		d2f = d2f1;
+		}
+	if(f1 < 0.) return -2; //photon leaves the capillary
+
+	//Newton iterations, kept inside the bracket [t_lo, t_hi] by bisection
+	t_lo = t;
+	t_hi = t1;
+	t = t1;
+	f = f1;
+	df = df1;
+	for(it=0; it<50 && f != 0.; it++){
+		if(fabs(df) > EPSILON) t1 = t - f/df;
+			else t1 = t_lo - 1.;
+		if(t1 <= t_lo || t1 >= t_hi) t1 = 0.5*(t_lo+t_hi);
+		if(fabs(t1-t) < 1.e-13*(1.+t)) break;
+		t = t1;
+		f = shape_dist(shape, chan_x, chan_y, rh0, v, t, &df, &d2f, u);
+		if(f < 0.) t_lo = t;
+			else t_hi = t;
+		}
+
+	rh1[0] = rh0[0] + t*v[0];
+	rh1[1] = rh0[1] + t*v[1];
+	rh1[2] = rh0[2] + t*v[2];
+	//surface normal: gradient of f
+	e = shape_eval(&shape->ext, rh1[2], &de, &d2e);
+	r = shape_eval(&shape->chan, rh1[2], &dr, &d2r);
+	u[0] = rh1[0] - chan_x*e;
+	u[1] = rh1[1] - chan_y*e;
+	rn[0] = u[0];
+	rn[1] = u[1];
+	rn[2] = -1.*(u[0]*de*chan_x + u[1]*de*chan_y) - r*dr;
+	norm(rn, (int)3);
+	*calf = scalar(rn,v);
+	if(*calf < (double)0) return -2;
+
+	return 0;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Bounce histories: the photon geometry does not depend on energy or wall material, so recording the
+// grazing angle, escape path, leak position and direction of every reflection, and the final position and
+// direction, allows re-weighting the run for a new material, roughness or energy grid (-reweight).
+// File layout: header (HIST_MAGIC, nmax, d_source, cl, d_screen, istart, ienter, n_photon), then per
+// photon: n_bounce, status (1 transmitted, 0 not, 2 dropped at the weight cutoff), w_gamma, rh[3], v[3]
+// and n_bounce hist_bounce records. Recording does not change the traced run, so a dropped photon's
+// history stops at the bounce that took it below the cutoff.
+struct hist_file *hist_open(char *filename, struct inp_file *cap, struct cap_profile *profile)
+	{
+	struct hist_file *hist = malloc(sizeof(struct hist_file));
+	long zero = 0;
+
+	if(hist == NULL){
+		printf("Could not allocate history memory.\n");
+		exit(0);
+		}
+	hist->fptr = fopen(filename,"wb");
+	if(hist->fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	hist->n_photon = 0;
+	fwrite(HIST_MAGIC,sizeof(char),sizeof(HIST_MAGIC),hist->fptr);
+	fwrite(&profile->nmax,sizeof(int),1,hist->fptr);
+	fwrite(&cap->d_source,sizeof(double),1,hist->fptr);
+	fwrite(&profile->cl,sizeof(double),1,hist->fptr);
+	fwrite(&cap->d_screen,sizeof(double),1,hist->fptr);
+	//photon totals are filled in by hist_close
+	hist->off_totals = ftell(hist->fptr);
+	fwrite(&zero,sizeof(long),1,hist->fptr);
+	fwrite(&zero,sizeof(long),1,hist->fptr);
+	fwrite(&zero,sizeof(long),1,hist->fptr);
+
+	return hist;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the buffered photon histories of one thread to the history file
+void hist_flush(struct calcstruct *calc)
+	{
+	#pragma omp critical(history)
+		{
+		fwrite(calc->hbuf,sizeof(char),calc->n_hbuf,calc->hist->fptr);
+		}
+	calc->n_hbuf = 0;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Fill in the photon totals of a history or exit weight file and close it
+void hist_close(struct hist_file *hist, long istart, long ienter)
+	{
+	fseek(hist->fptr,hist->off_totals,SEEK_SET);
+	fwrite(&istart,sizeof(long),1,hist->fptr);
+	fwrite(&ienter,sizeof(long),1,hist->fptr);
+	fwrite(&hist->n_photon,sizeof(long),1,hist->fptr);
+	fclose(hist->fptr);
+	free(hist);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+void hist_add_bounce(struct calcstruct *calc, double alf, double desc, double xp, double yp)
+	{
+	if(calc->n_bounce == calc->max_bounce){
+		calc->max_bounce = 2*calc->max_bounce;
+		calc->bounce = realloc(calc->bounce,sizeof(struct hist_bounce)*calc->max_bounce);
+		if(calc->bounce == NULL){
+			printf("Could not allocate history bounce memory.\n");
+			exit(0);
+			}
+		}
+	calc->bounce[calc->n_bounce].alf = (float)alf;
+	calc->bounce[calc->n_bounce].desc = (float)desc;
+	calc->bounce[calc->n_bounce].xp = (float)xp;
+	calc->bounce[calc->n_bounce].yp = (float)yp;
+	calc->bounce[calc->n_bounce].dxp = (float)(calc->v[0]/calc->v[2]);
+	calc->bounce[calc->n_bounce].dyp = (float)(calc->v[1]/calc->v[2]);
+	calc->bounce[calc->n_bounce].ix = calc->ix;
+	calc->n_bounce++;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Append the history of the finished photon to the thread's output buffer
+void hist_end_photon(struct calcstruct *calc, int status)
+	{
+	long size;
+
+	size = 2*sizeof(int) + sizeof(float) + 6*sizeof(double) + calc->n_bounce*sizeof(struct hist_bounce);
+	if(calc->n_hbuf + size > calc->max_hbuf) hist_flush(calc);
+	if(size > calc->max_hbuf){ //very long history, grow the buffer
+		calc->max_hbuf = size;
+		calc->hbuf = realloc(calc->hbuf,calc->max_hbuf);
+		if(calc->hbuf == NULL){
+			printf("Could not allocate history buffer memory.\n");
+			exit(0);
+			}
+		}
+	memcpy(calc->hbuf+calc->n_hbuf,&calc->n_bounce,sizeof(int));
+	memcpy(calc->hbuf+calc->n_hbuf+sizeof(int),&status,sizeof(int));
+	memcpy(calc->hbuf+calc->n_hbuf+2*sizeof(int),&calc->w_gamma,sizeof(float));
+	memcpy(calc->hbuf+calc->n_hbuf+2*sizeof(int)+sizeof(float),calc->rh,3*sizeof(double));
+	memcpy(calc->hbuf+calc->n_hbuf+2*sizeof(int)+sizeof(float)+3*sizeof(double),calc->v,3*sizeof(double));
+	memcpy(calc->hbuf+calc->n_hbuf+2*sizeof(int)+sizeof(float)+6*sizeof(double),calc->bounce,calc->n_bounce*sizeof(struct hist_bounce));
+	calc->n_hbuf = calc->n_hbuf + size;
+	#pragma omp atomic
+	calc->hist->n_photon++;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Exit weights: the screen position and the weight at every energy of each transmitted photon, so
+// the run can be folded with any source spectrum and filter stack afterwards (-fold).
+// File layout: header (EXITW_MAGIC, n_energy, e_start, delta_e, d_screen, binsize, istart, ienter,
+// n_photon), then per transmitted photon: xp, yp and w[0..n_energy] as floats.
+struct hist_file *exitw_open(char *filename, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu)
+	{
+	struct hist_file *exitw = malloc(sizeof(struct hist_file));
+	long zero = 0;
+
+	if(exitw == NULL){
+		printf("Could not allocate exit weight memory.\n");
+		exit(0);
+		}
+	exitw->fptr = fopen(filename,"wb");
+	if(exitw->fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	exitw->n_photon = 0;
+	fwrite(EXITW_MAGIC,sizeof(char),sizeof(EXITW_MAGIC),exitw->fptr);
+	fwrite(&absmu->n_energy,sizeof(int),1,exitw->fptr);
+	fwrite(&cap->e_start,sizeof(float),1,exitw->fptr);
+	fwrite(&cap->delta_e,sizeof(float),1,exitw->fptr);
+	fwrite(&cap->d_screen,sizeof(double),1,exitw->fptr);
+	fwrite(&profile->binsize,sizeof(double),1,exitw->fptr);
+	//photon totals are filled in by hist_close
+	exitw->off_totals = ftell(exitw->fptr);
+	fwrite(&zero,sizeof(long),1,exitw->fptr);
+	fwrite(&zero,sizeof(long),1,exitw->fptr);
+	fwrite(&zero,sizeof(long),1,exitw->fptr);
+
+	return exitw;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the buffered exit weights of one thread to the exit weight file
+void exitw_flush(struct calcstruct *calc)
+	{
+	#pragma omp critical(exitw)
+		{
+		fwrite(calc->ebuf,sizeof(char),calc->n_ebuf,calc->exitw->fptr);
+		}
+	calc->n_ebuf = 0;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Append the screen position and exit weights of a transmitted photon to the thread's output buffer
+void exitw_add_photon(struct calcstruct *calc, int n_energy, float xp, float yp)
+	{
+	long size;
+
+	size = (n_energy+3)*sizeof(float);
+	if(calc->n_ebuf + size > HIST_BUF) exitw_flush(calc);
+	memcpy(calc->ebuf+calc->n_ebuf,&xp,sizeof(float));
+	memcpy(calc->ebuf+calc->n_ebuf+sizeof(float),&yp,sizeof(float));
+	memcpy(calc->ebuf+calc->n_ebuf+2*sizeof(float),calc->w,(n_energy+1)*sizeof(float));
+	calc->n_ebuf = calc->n_ebuf + size;
+	#pragma omp atomic
+	calc->exitw->n_photon++;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Reflectivity of the capillary wall (density in g/cm3, linear attenuation coefficient amu and
+// scatter factor scatf at energy e) for a photon at grazing angle alf, according to Fresnel expression
+double reflectivity(double alf, float e, float density, float amu, double scatf)
+	{
+	double complex alfa, beta; //alfa and beta component for Fresnel equation delta term (delta = alfa - i*beta)
+	double complex rtot; //reflectivity
+
+	alfa = (double)(HC/e)*(HC/e)*((N_AVOG*R0*density)/(2*PI)) * scatf;
+	beta = (double) (HC)/(4.*PI) * (amu/e);
+
+	rtot = ((complex double)alf - csqrt(cpow((complex double)alf,2) - 2.*(alfa - beta*I))) / ((complex double)alf + csqrt(cpow((complex double)alf,2) - 2.*(alfa - beta*I)));
+	rtot = creal(cpow(cabs(rtot),2.));
+
+	return creal(rtot);
+	}
+// ---------------------------------------------------------------------------------------------------
+// Critical angle of total external reflection at energy index i [rad]
+double crit_angle(struct inp_file *cap, struct mumc *absmu, int i)
+	{
+	float e = cap->e_start + i * cap->delta_e;
+
+	return sqrt(2.*(double)(HC/e)*(HC/e)*((N_AVOG*R0*cap->density)/(2*PI)) * absmu->arr[i].scatf);
+	}
+// ---------------------------------------------------------------------------------------------------
+// start(), capil(), reflect() and count() take the kernel flags (K_*) that are fixed for the whole run.
+// They are inlined in the trace kernel variants with constant flags, so the compiler drops the dead work.
+static inline int reflect(double alf, struct inp_file *cap, struct mumc *absmu, struct cap_profile *profile, struct leakstruct *leaks, struct calcstruct *calc, int *thread_id, const int flags)
 	{
+	const int smooth = cap->sig_rough == 0.;
+	const int spots = (flags & K_GENERIC) ? cap->spots : (flags & K_SPOTS) != 0;
+	const int n_energy = absmu->n_energy;
 	int i;
 	double desc; //distance in capillary at which photon escaped divided by propagation vector in z direction
 	float e; //energy
 	double cons1, r_rough;
-	double complex alfa, beta; //alfa and beta component for Fresnel equation delta term (delta = alfa - i*beta)
-	double complex rtot; //reflectivity
+	double rtot; //reflectivity
 	float wleak;
 	double c; //distance between photon interaction and screen, divided by propagation vector in z direction
 	double xp, yp; //position on screen where photon will end up if unobstructed
-	int ind_x, ind_y; //indices of array lspot where photon will hit screen
+	double *lbin[NSYM]; //lspot bins where photon (and its symmetric images) will hit screen
+	double *zlbin[NSCREEN][NSYM]; //idem for the additional screens
+	float w_sym; //weight of each image
+	int k, l;
 
 	//escape
 	desc = (profile->cl + cap->d_source - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
 	if(desc < 0) desc = profile->cl;
-	for(i=0; i <= absmu->n_energy; i++){
+	c = (cap->d_screen - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
+	xp = calc[*thread_id].rh[0] + c*calc[*thread_id].v[0];
+	yp = calc[*thread_id].rh[1] + c*calc[*thread_id].v[1];
+	if(spots){
+		spot_bin_images(leaks->lspot, xp, yp, cap->n_sym, lbin);
+		for(k=0; k<cap->n_screen; k++){
+			c = (cap->z_screens[k] - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
+			spot_bin_images(leaks->zlspot[k], calc[*thread_id].rh[0] + c*calc[*thread_id].v[0],
+				calc[*thread_id].rh[1] + c*calc[*thread_id].v[1], cap->n_sym, zlbin[k]);
+			}
+		}
+	w_sym = (float)1./cap->n_sym;
+	if(calc[*thread_id].hist != NULL) hist_add_bounce(&calc[*thread_id], alf, desc, xp, yp);
+	for(i=0; i <= n_energy; i++){
 		e = cap->e_start + i * cap->delta_e;
-		cons1 = (double)(1.01358e0*e)*alf*cap->sig_rough;
-		r_rough = exp(-1*cons1*cons1);
-
-		alfa = (double)(HC/e)*(HC/e)*((N_AVOG*R0*cap->density)/(2*PI)) * absmu->arr[i].scatf;
-		beta = (double) (HC)/(4.*PI) * (absmu->arr[i].amu/e);
+		if(smooth){
+			r_rough = 1.;
+			} else {
+			cons1 = (double)(1.01358e0*e)*alf*cap->sig_rough;
+			r_rough = exp(-1*cons1*cons1);
+			}
 
-		//reflectivity according to Fresnel expression
-		rtot = ((complex double)alf - csqrt(cpow((complex double)alf,2) - 2.*(alfa - beta*I))) / ((complex double)alf + csqrt(cpow((complex double)alf,2) - 2.*(alfa - beta*I)));
-		rtot = creal(cpow(cabs(rtot),2.));
-		//printf("Energy: %f, creal(rtot): %lf, cimag(rtot): %lf\n",e, creal(rtot), cimag(rtot));
+		rtot = reflectivity(alf, e, cap->density, absmu->arr[i].amu, absmu->arr[i].scatf);
 		wleak = (1.-rtot) * calc[*thread_id].w[i] * exp(-1.*desc * absmu->arr[i].amu);
 		leaks->leak[i] = leaks->leak[i] + wleak;
-		if(i==0){
-			c = (cap->d_screen - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
-			xp = calc[*thread_id].rh[0] + c*calc[*thread_id].v[0];
-			yp = calc[*thread_id].rh[1] + c*calc[*thread_id].v[1];
-			ind_x = (int)floor(xp/profile->binsize)+NSPOT/2;
-			ind_y = (int)floor(yp/profile->binsize)+NSPOT/2;
-			if(ind_x < NSPOT && ind_x >= 0){
-				if(ind_y < NSPOT && ind_y >= 0){
-					leaks->lspot[ind_x][ind_y] = leaks->lspot[ind_x][ind_y] + wleak;
-					}
+		if(spots && absmu->arr[i].layer >= 0){
+			for(l=0; l<cap->n_sym; l++){
+				if(lbin[l] != NULL) lbin[l][absmu->arr[i].layer] += wleak*w_sym;
+				for(k=0; k<cap->n_screen; k++) if(zlbin[k][l] != NULL) zlbin[k][l][absmu->arr[i].layer] += wleak*w_sym;
 				}
 			}
 		calc[*thread_id].w[i] = calc[*thread_id].w[i] * (float)(rtot * r_rough);
 		if(calc[*thread_id].w[i] != calc[*thread_id].w[i]){
 			printf("thread:%d, w[%d]:%f,rtot:%lf, r_rough:%lf, (float)(rtot*r_rough):%f\n",
-				*thread_id,i,calc[*thread_id].w[i],creal(rtot),r_rough,(float)(rtot * r_rough));
+				*thread_id,i,calc[*thread_id].w[i],rtot,r_rough,(float)(rtot * r_rough));
 			exit(0);
 			}
-		} //for(i=0; i <= absmu->n_energy; i++)
+		} //for(i=0; i <= n_energy; i++)
 
-	if(calc[*thread_id].w[0] < 1.e-4) return -2;
+	//photons below the weight threshold are dropped, a recorded history ends at this bounce
+	if(calc[*thread_id].w[0] < 1.e-4){
+		if(calc[*thread_id].hist != NULL) hist_end_photon(&calc[*thread_id], 2);
+		return -2;
+		}
 
 	return 0;
 	}
 // ---------------------------------------------------------------------------------------------------
-void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+// Quasi-Monte Carlo sampling: the first start attempt of photon icount uses point icount/n_rep+1 of
+// a Halton sequence (bases 2, 3, 5, 7, 11) instead of the rng, scrambled by random digit permutations
+// that differ per replicate (icount % n_rep). Each replicate is an unbiased estimate on its own, so
+// their spread gives the error. The channel is picked from a table with the same probabilities as the
+// rejection sampling in start(), so it takes a single coordinate.
+struct qmc_sampler *qmc_alloc(int n_rep, double rseed, struct ini_polycap *pcap_ini)
 	{
-	int i, flag_restart;
-	int ix_cap, iy_cap; //indices of selected channel
-	double dx; //distance between photon's source origin and PC entrance coordinates (projected on same plane)
-		// dx is just a measure to see if can quit while loop or not, essentially only runs once through it
-	double r; //random nr
-	double ra, rb, rr; //coordinates (ra, rb) and distance from center (rr) of selected channel
-	double cosphi, sinphi; //angle between horizontal and selected channel (along rr)
-	double cx; //relative distance from PC centre (compared to PC external radius)
-	double rad; //random radius from centre of source size (between 0 and sigx)
-	double fi; //random angle in which photon was emitted from source (between 0 and 2PI) 
-	double x, y; //coordinates from which photon was emitted
-	double xpc, ypc; //coordinates from which photon was emitted given src_sigx and src_sigy are (nearly) 0
-	double gamma, w_gamma; //photon origin to selected capillary angle and weight (cos(gamma))
-	double c; //distance bridged by photon between source and selected capillary
+	const int base[NQMC] = {2, 3, 5, 7, 11};
+	int r, d, k, j, l, n, ix, iy;
+	unsigned char *perm, tmp;
+	double lo, hi, *p;
+	gsl_rng *rn;
+	struct qmc_sampler *qmc = malloc(sizeof(struct qmc_sampler));
 
-	calc[*thread_id].i_refl = (long)0;
+	if(qmc == NULL){
+		printf("Could not allocate qmc memory.\n");
+		exit(0);
+		}
+	qmc->n_rep = n_rep;
+	qmc->perm = malloc(sizeof(*qmc->perm)*n_rep*NQMC*QMC_NDIG*QMC_BMAX);
+	if(qmc->perm == NULL){
+		printf("Could not allocate qmc memory.\n");
+		exit(0);
+		}
+	rn = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rn,rseed);
+	for(r=0; r<n_rep; r++){
+		for(d=0; d<NQMC; d++){
+			for(k=0; k<QMC_NDIG; k++){
+				perm = &qmc->perm[((r*NQMC+d)*QMC_NDIG+k)*QMC_BMAX];
+				for(j=0; j<base[d]; j++) perm[j] = (unsigned char)j;
+				for(j=base[d]-1; j>0; j--){
+					l = (int)gsl_rng_uniform_int(rn,j+1);
+					tmp = perm[j];
+					perm[j] = perm[l];
+					perm[l] = tmp;
+					}
+				}
+			}
+		}
+	gsl_rng_free(rn);
 
-	for(i=0; i <= absmu->n_energy; i++) calc[*thread_id].w[i] = (float)1;
-	dx = 2e9; //set dx very high so it is certainly > single capillary radius (profil)
-	while(dx > profile->arr[0].profil){
-		//select capil
-		flag_restart = 0;
-		do{
-			r = gsl_rng_uniform(calc[*thread_id].rn);
-			ix_cap = floor( pcap_ini->n_chan_max * (2.*fabs(r)-1.) + 0.5);
-			r = gsl_rng_uniform(calc[*thread_id].rn);
-			iy_cap = floor( pcap_ini->n_chan_max * (2.*fabs(r)-1.) + 0.5);
-			} while( (double)abs(iy_cap+ix_cap) > pcap_ini->n_chan_max );
-		//calc_tube/calc_axs
-		ra = ix_cap*pcap_ini->cap_unita[0] + iy_cap*pcap_ini->cap_unitb[0];
-		rb = ix_cap*pcap_ini->cap_unita[1] + iy_cap*pcap_ini->cap_unitb[1];
-		rr = sqrt(ra*ra+rb*rb);
-		if(rr <= DELTA){
-			cosphi = 0;
-			sinphi = 0;
+	//probability of each index drawn as floor(n_chan_max*(2r-1)+0.5) in start()
+	n = (int)floor(pcap_ini->n_chan_max+0.5);
+	p = malloc(sizeof(*p)*(2*n+1));
+	qmc->ix = malloc(sizeof(*qmc->ix)*(2*n+1)*(2*n+1));
+	qmc->iy = malloc(sizeof(*qmc->iy)*(2*n+1)*(2*n+1));
+	qmc->cdf = malloc(sizeof(*qmc->cdf)*(2*n+1)*(2*n+1));
+	if(p == NULL || qmc->ix == NULL || qmc->iy == NULL || qmc->cdf == NULL){
+		printf("Could not allocate qmc memory.\n");
+		exit(0);
+		}
+	for(ix=-n; ix<=n; ix++){
+		lo = ((ix-0.5)/pcap_ini->n_chan_max+1.)/2.;
+		hi = ((ix+0.5)/pcap_ini->n_chan_max+1.)/2.;
+		if(lo < 0.) lo = 0.;
+		if(hi > 1.) hi = 1.;
+		p[ix+n] = hi > lo ? hi-lo : 0.;
+		}
+	qmc->n_chan = 0;
+	lo = 0.;
+	for(ix=-n; ix<=n; ix++){
+		for(iy=-n; iy<=n; iy++){
+			if((double)abs(iy+ix) > pcap_ini->n_chan_max || p[ix+n]*p[iy+n] <= 0.) continue;
+			lo = lo + p[ix+n]*p[iy+n];
+			qmc->ix[qmc->n_chan] = ix;
+			qmc->iy[qmc->n_chan] = iy;
+			qmc->cdf[qmc->n_chan] = lo;
+			qmc->n_chan++;
+			}
+		}
+	for(k=0; k<qmc->n_chan; k++) qmc->cdf[k] = qmc->cdf[k]/lo;
+	free(p);
+
+	return qmc;
+	}
+// ---------------------------------------------------------------------------------------------------
+void qmc_free(struct qmc_sampler *qmc)
+	{
+	free(qmc->perm);
+	free(qmc->ix);
+	free(qmc->iy);
+	free(qmc->cdf);
+	free(qmc);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Scrambled Halton point number index of replicate rep
+void qmc_point(struct qmc_sampler *qmc, long index, int rep, double *u)
+	{
+	const int base[NQMC] = {2, 3, 5, 7, 11};
+	int d, k;
+	long q;
+	double f;
+	unsigned char *perm;
+
+	for(d=0; d<NQMC; d++){
+		q = index;
+		f = 1./base[d];
+		u[d] = 0.;
+		for(k=0; k<QMC_NDIG && f > 1.e-16; k++){
+			perm = &qmc->perm[((rep*NQMC+d)*QMC_NDIG+k)*QMC_BMAX];
+			u[d] = u[d] + perm[q % base[d]]*f;
+			q = q / base[d];
+			f = f / base[d];
+			}
+		if(u[d] >= 1.) u[d] = 1.-1.e-16;
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Select the channel for quasi-random coordinate u
+void qmc_channel(struct qmc_sampler *qmc, double u, int *ix_cap, int *iy_cap)
+	{
+	int lo=0, hi=qmc->n_chan-1, mid;
+
+	while(lo < hi){
+		mid = (lo+hi)/2;
+		if(qmc->cdf[mid] > u) hi = mid;
+			else lo = mid+1;
+		}
+	*ix_cap = qmc->ix[lo];
+	*iy_cap = qmc->iy[lo];
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Allocate an empty channel map. The channels (ix,iy) drawn in start() lie in the hexagon
+// |ix|, |iy|, |ix+iy| <= n_chan_max and are stored row by row, without the corners of the square.
+struct chan_map *chan_alloc(struct ini_polycap *pcap_ini, struct mumc *absmu)
+	{
+	struct chan_map *map;
+	int ix, hi, i;
+	int *n_band; //amount of energies per band
+
+	map = malloc(sizeof(struct chan_map));
+	if(map == NULL){
+		printf("Could not allocate channel map memory.\n");
+		exit(0);
+		}
+	map->n = (int)floor(pcap_ini->n_chan_max+0.5);
+	map->lo = malloc(sizeof(*map->lo)*(2*map->n+1));
+	map->off = malloc(sizeof(*map->off)*(2*map->n+2));
+	map->band = malloc(sizeof(*map->band)*(absmu->n_energy+1));
+	map->band_w = malloc(sizeof(*map->band_w)*(absmu->n_energy+1));
+	n_band = calloc(NCHAN_BAND,sizeof(*n_band));
+	if(map->lo == NULL || map->off == NULL || map->band == NULL || map->band_w == NULL || n_band == NULL){
+		printf("Could not allocate channel map memory.\n");
+		exit(0);
+		}
+	map->n_chan = 0;
+	for(ix=-map->n; ix<=map->n; ix++){
+		map->lo[ix+map->n] = (int)ceil(-pcap_ini->n_chan_max-ix);
+		if(map->lo[ix+map->n] < -map->n) map->lo[ix+map->n] = -map->n;
+		hi = (int)floor(pcap_ini->n_chan_max-ix);
+		if(hi > map->n) hi = map->n;
+		map->off[ix+map->n] = map->n_chan;
+		if(hi >= map->lo[ix+map->n]) map->n_chan = map->n_chan + hi-map->lo[ix+map->n]+1;
+		}
+	map->off[2*map->n+1] = map->n_chan;
+	for(i=0; i<=absmu->n_energy; i++){
+		map->band[i] = i*NCHAN_BAND/(absmu->n_energy+1);
+		n_band[map->band[i]]++;
+		}
+	for(i=0; i<=absmu->n_energy; i++) map->band_w[i] = 1./n_band[map->band[i]];
+	free(n_band);
+	map->rec = calloc(map->n_chan*NCHAN_REC,sizeof(*map->rec));
+	if(map->rec == NULL){
+		printf("Could not allocate channel map memory.\n");
+		exit(0);
+		}
+
+	return map;
+	}
+// ---------------------------------------------------------------------------------------------------
+void chan_free(struct chan_map *map)
+	{
+	free(map->lo);
+	free(map->off);
+	free(map->band);
+	free(map->band_w);
+	free(map->rec);
+	free(map);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Add the accumulators of channel map src to dst
+void chan_merge(struct chan_map *dst, struct chan_map *src)
+	{
+	long i;
+
+	for(i=0; i<dst->n_chan*NCHAN_REC; i++) dst->rec[i] = dst->rec[i] + src->rec[i];
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the channel map (*.out.chan file) of the channels photons entered: the lattice indices and
+// entrance position, the entered photons, and per entered photon the fraction reaching the exit, the
+// absorbed weight (lowest energy) and the transmitted weight averaged over each energy band, plus
+// the mean amount of bounces of the photons reaching the exit
+void write_chan(struct inp_file *cap, struct ini_polycap *pcap_ini, struct mumc *absmu, struct chan_map *map)
+	{
+	FILE *fptr;
+	char f_chan[110];
+	int ix, iy, k;
+	long i, n_row=0;
+	double *rec;
+	float e_lo, e_hi;
+
+	for(i=0; i<map->n_chan; i++) if(map->rec[i*NCHAN_REC] > 0.) n_row++;
+	sprintf(f_chan,"%.99s.chan",cap->out);
+	fptr = fopen(f_chan,"w");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",f_chan);
+		exit(0);
+		}
+	fprintf(fptr,"Channel map of %s\n",cap->out);
+	fprintf(fptr,"Energy bands [keV]:");
+	for(k=0; k<NCHAN_BAND; k++){
+		e_lo = -1.;
+		e_hi = -1.;
+		for(i=0; i<=absmu->n_energy; i++){
+			if(map->band[i] != k) continue;
+			if(e_lo < 0.) e_lo = cap->e_start+i*cap->delta_e;
+			e_hi = cap->e_start+i*cap->delta_e;
+			}
+		fprintf(fptr,"\t%.2f-%.2f",e_lo,e_hi); //-1 for a band without energies
+		}
+	fprintf(fptr,"\n  ix\tiy\tx [cm]\t\ty [cm]\t\tentered\texited\t\tbounces\t\tabsorbed\tI/I0 per band\n");
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%ld\t%d\n",n_row,8+NCHAN_BAND);
+	for(ix=-map->n; ix<=map->n; ix++){
+		for(i=map->off[ix+map->n]; i<map->off[ix+map->n+1]; i++){
+			rec = &map->rec[i*NCHAN_REC];
+			if(rec[0] <= 0.) continue;
+			iy = map->lo[ix+map->n] + (int)(i-map->off[ix+map->n]);
+			fprintf(fptr,"%d\t%d\t%f\t%f\t%.0f\t%f\t%f\t%f",ix,iy,ix*pcap_ini->cap_unita[0]+iy*pcap_ini->cap_unitb[0],
+				ix*pcap_ini->cap_unita[1]+iy*pcap_ini->cap_unitb[1],rec[0],rec[1]/rec[0],(rec[1] > 0.) ? rec[2]/rec[1] : 0.,rec[3]/rec[0]);
+			for(k=0; k<NCHAN_BAND; k++) fprintf(fptr,"\t%f",rec[4+k]/rec[0]);
+			fprintf(fptr,"\n");
+			}
+		}
+	fclose(fptr);
+	printf("Channel map of %ld channels written to %s\n",n_row,f_chan);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Next uniform random number of the start of a photon: quasi-random coordinate dim during
+// the first start attempt in quasi-random mode, else from the thread's rng
+double start_uniform(struct calcstruct *calc, int dim)
+	{
+	if(calc->n_u > 0) return calc->u[dim];
+
+	return gsl_rng_uniform(calc->rn);
+	}
+// ---------------------------------------------------------------------------------------------------
+// Precompute NWAVE wall slope fields along the capillary for waviness with rms height sig_wave and
+// Gaussian correlation exp(-dz^2/corr_length^2), by spectral synthesis: the height is a sum of
+// NWAVE_MODE cosines with random phases and wave numbers drawn from the Gaussian power spectrum.
+// Every channel uses one of the fields, so the cost per bounce is a table lookup.
+struct wave_pool *wave_alloc(struct inp_file *cap, struct cap_profile *profile, double rseed)
+	{
+	int f, c, m, j;
+	double k[NWAVE_MODE], phi[NWAVE_MODE], amp, z, sum;
+	gsl_rng *rn;
+	struct wave_pool *wave = malloc(sizeof(struct wave_pool));
+
+	if(wave == NULL || cap->corr_length <= 0.){
+		printf("Waviness needs a positive correlation length.\n");
+		exit(0);
+		}
+	wave->n_pts = (int)ceil(4.*profile->cl/cap->corr_length) + 2; //4 points per correlation length
+	if(wave->n_pts > NWAVE_MAXPTS){
+		wave->n_pts = NWAVE_MAXPTS;
+		printf("Waviness correlation length below the field resolution of %g cm.\n",profile->cl/(NWAVE_MAXPTS-2));
+		}
+	wave->dz = profile->cl/(wave->n_pts-2);
+	wave->slope = malloc(sizeof(float)*NWAVE*wave->n_pts*2);
+	if(wave->slope == NULL){
+		printf("Could not allocate waviness memory.\n");
+		exit(0);
+		}
+	rn = gsl_rng_alloc(gsl_rng_mt19937);
+	gsl_rng_set(rn,rseed);
+	amp = cap->sig_wave*sqrt(2./NWAVE_MODE);
+	for(f=0; f<NWAVE; f++){
+		for(c=0; c<2; c++){
+			for(m=0; m<NWAVE_MODE; m++){
+				k[m] = gsl_ran_gaussian(rn, sqrt(2.)/cap->corr_length);
+				phi[m] = 2.*PI*gsl_rng_uniform(rn);
+				}
+			for(j=0; j<wave->n_pts; j++){
+				z = j*wave->dz;
+				for(m=0, sum=0.; m<NWAVE_MODE; m++) sum -= k[m]*sin(k[m]*z + phi[m]);
+				wave->slope[(f*wave->n_pts+j)*2+c] = (float)(amp*sum);
+				}
+			}
+		}
+	gsl_rng_free(rn);
+
+	return wave;
+	}
+// ---------------------------------------------------------------------------------------------------
+void wave_free(struct wave_pool *wave)
+	{
+	free(wave->slope);
+	free(wave);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Tilt the wall normal rn at height z [cm from the capillary entrance] by the slopes of the channel's
+// waviness field, and update calf (cosine of the angle to photon direction v). The tilt is skipped when
+// the photon would no longer hit the tilted wall, or would be reflected out through the mean wall.
+void wave_normal(struct wave_pool *wave, float *field, double z, double v[3], double rn[3], double *calf)
+	{
+	int i, j;
+	double f, sz, sp;
+	double ez[3], ep[3], rw[3], cw, vr[3];
+
+	f = z/wave->dz;
+	if(f < 0.) f = 0.;
+	j = (int)f;
+	if(j > wave->n_pts-2) j = wave->n_pts-2;
+	f = f-j;
+	sz = (1.-f)*field[j*2] + f*field[(j+1)*2];
+	sp = (1.-f)*field[j*2+1] + f*field[(j+1)*2+1];
+
+	//axial (ez) and azimuthal (ep) tangents of the wall
+	ez[0] = -rn[2]*rn[0];
+	ez[1] = -rn[2]*rn[1];
+	ez[2] = 1.-rn[2]*rn[2];
+	norm(ez, 3);
+	ep[0] = rn[1]*ez[2] - rn[2]*ez[1];
+	ep[1] = rn[2]*ez[0] - rn[0]*ez[2];
+	ep[2] = rn[0]*ez[1] - rn[1]*ez[0];
+	for(i=0; i<3; i++) rw[i] = rn[i] - sz*ez[i] - sp*ep[i];
+	norm(rw, 3);
+	cw = scalar(rw,v);
+	if(cw <= 0.) return;
+	for(i=0; i<3; i++) vr[i] = v[i] - 2.*cw*rw[i];
+	if(scalar(vr,rn) >= 0.) return;
+	for(i=0; i<3; i++) rn[i] = rw[i];
+	*calf = cw;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Source point (x,y) [cm] of a source model other than SRC_DISK, from two uniform numbers (u1,u2)
+static inline void source_point(struct source_model *src, double u1, double u2, double *x, double *y)
+	{
+	int k; //pixel
+	double f, r, fi;
+
+	switch(src->type){
+		case SRC_GAUSS: //Box-Muller
+			r = sqrt(-2.*log(1.-u1));
+			fi = 2.*PI*u2;
+			*x = src->a * r * cos(fi);
+			*y = src->b * r * sin(fi);
+			break;
+		case SRC_ELLIPSE:
+			r = sqrt(u1);
+			fi = 2.*PI*u2;
+			*x = src->a * r * cos(fi);
+			*y = src->b * r * sin(fi);
+			break;
+		default: //SRC_IMAGE: the part of u1 left after picking the pixel places the point along x
+			f = u1*src->nx*src->ny;
+			k = (int)f;
+			if(k >= src->nx*src->ny) k = src->nx*src->ny-1;
+			f = f - k;
+			if(f < src->prob[k]){
+				f = f/src->prob[k];
+				} else {
+				f = (f-src->prob[k])/(1.-src->prob[k]);
+				k = src->alias[k];
+				}
+			*x = (k % src->nx + f - 0.5*src->nx) * src->a;
+			*y = (0.5*src->ny - k / src->nx - u2) * src->b;
+			break;
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Emission weight of direction v relative to the emission along the optical axis, linearly
+// interpolated in the polar angle; beyond the tabulated angles that of the last one
+static inline double source_weight(struct source_model *src, double v[3])
+	{
+	int k;
+	double t;
+
+	t = acos(fmin(v[2],1.))/src->ang_max*src->n_ang;
+	k = (int)t;
+	if(k >= src->n_ang) return src->ang_w[src->n_ang];
+
+	return src->ang_w[k] + (src->ang_w[k+1]-src->ang_w[k])*(t-k);
+	}
+// ---------------------------------------------------------------------------------------------------
+static inline void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id, const int flags)
+	{
+	const int uniform = cap->src_sigx*cap->src_sigy < 1.e-20;
+	const int n_energy = absmu->n_energy;
+	int i, flag_restart;
+	int ix_cap=0, iy_cap=0; //indices of selected channel
+	double dx; //distance between photon's source origin and PC entrance coordinates (projected on same plane)
+		// dx is just a measure to see if can quit while loop or not, essentially only runs once through it
+	double r; //random nr
+	double ra, rb, rr; //coordinates (ra, rb) and distance from center (rr) of selected channel
+	double cosphi, sinphi; //angle between horizontal and selected channel (along rr)
+	double cx; //relative distance from PC centre (compared to PC external radius)
+	double rad; //random radius from centre of source size (between 0 and sigx)
+	double fi; //random angle in which photon was emitted from source (between 0 and 2PI) 
+	double x, y; //coordinates from which photon was emitted
+	double xpc, ypc; //coordinates from which photon was emitted given src_sigx and src_sigy are (nearly) 0
+	double gamma, w_gamma=1.; //photon origin to selected capillary angle and weight (cos(gamma))
+	double c; //distance bridged by photon between source and selected capillary
+
+	calc[*thread_id].i_refl = (long)0;
+	calc[*thread_id].ix = 0;
+
+	for(i=0; i <= n_energy; i++) calc[*thread_id].w[i] = (float)1;
+	dx = 2e9; //set dx very high so it is certainly > single capillary radius (profil)
+	while(dx > profile->arr[0].profil){
+		//select capil
+		flag_restart = 0;
+		if(calc[*thread_id].n_u > 0){
+			qmc_channel(calc[*thread_id].qmc, calc[*thread_id].u[0], &ix_cap, &iy_cap);
+			} else do{
+			r = gsl_rng_uniform(calc[*thread_id].rn);
+			ix_cap = floor( pcap_ini->n_chan_max * (2.*fabs(r)-1.) + 0.5);
+			r = gsl_rng_uniform(calc[*thread_id].rn);
+			iy_cap = floor( pcap_ini->n_chan_max * (2.*fabs(r)-1.) + 0.5);
+			} while( (double)abs(iy_cap+ix_cap) > pcap_ini->n_chan_max );
+		if(calc[*thread_id].wave != NULL){ //every channel keeps its own waviness
+			calc[*thread_id].wave_field = &calc[*thread_id].wave->slope[
+				((((unsigned int)ix_cap*73856093u) ^ ((unsigned int)iy_cap*19349663u)) % NWAVE)*calc[*thread_id].wave->n_pts*2];
+			}
+		//calc_tube/calc_axs
+		ra = ix_cap*pcap_ini->cap_unita[0] + iy_cap*pcap_ini->cap_unitb[0];
+		rb = ix_cap*pcap_ini->cap_unita[1] + iy_cap*pcap_ini->cap_unitb[1];
+		rr = sqrt(ra*ra+rb*rb);
+		if(rr <= DELTA){
+			cosphi = 0;
+			sinphi = 0;
 			}else{
 			cosphi = ra/rr;
 			sinphi = rb/rr;
 			}
 		cx = rr / profile->rtot1;
-		for(i=0; i <= profile->nmax; i++){
-			calc[*thread_id].sx[i] = profile->arr[i].d_arr * cosphi * cx;
-			calc[*thread_id].sy[i] = profile->arr[i].d_arr * sinphi * cx;
+		calc[*thread_id].chan_x = cosphi * cx;
+		calc[*thread_id].chan_y = sinphi * cx;
+		if(profile->shape == NULL){
+			for(i=0; i <= profile->nmax; i++){
+				calc[*thread_id].sx[i] = profile->arr[i].d_arr * cosphi * cx;
+				calc[*thread_id].sy[i] = profile->arr[i].d_arr * sinphi * cx;
+				}
 			}
 
 		//sourcp
-		r = gsl_rng_uniform(calc[*thread_id].rn);
-		rad = cap->src_x * sqrt(fabs(r)); //sqrt to simulate source intensity distribution (originally probably src_x * r/sqrt(r) )
-		if(rad != rad){
-			printf("rad: %lf, sigx: %lf, r:%lf, sqrt(r):%lf\n", rad, cap->src_x, r, sqrt(fabs(r)));
-			exit(0);
+		if(cap->source != NULL && cap->source->type != SRC_DISK){
+			r = start_uniform(&calc[*thread_id], 1);
+			source_point(cap->source, r, start_uniform(&calc[*thread_id], 2), &x, &y);
+			x = x + cap->src_shiftx;
+			y = y + cap->src_shifty;
+			} else {
+			r = start_uniform(&calc[*thread_id], 1);
+			rad = cap->src_x * sqrt(fabs(r)); //sqrt to simulate source intensity distribution (originally probably src_x * r/sqrt(r) )
+			if(rad != rad){
+				printf("rad: %lf, sigx: %lf, r:%lf, sqrt(r):%lf\n", rad, cap->src_x, r, sqrt(fabs(r)));
+				exit(0);
+				}
+			r = start_uniform(&calc[*thread_id], 2);
+			fi = (double)2.*PI*fabs(r);
+			x = rad * cos(fi) + cap->src_shiftx;
+			y = rad * sin(fi) + cap->src_shifty;
+			if(x != x){
+				printf("rh[0]: %lf, x:%lf, rad:%lf, fi:%lf, cos(fi):%lf, shiftx:%lf\n",
+					x,x,rad,fi,cos(fi),cap->src_shiftx);
+				exit(0);
+				}
 			}
-		r = gsl_rng_uniform(calc[*thread_id].rn);
-		fi = (double)2.*PI*fabs(r);
-		x = rad * cos(fi) + cap->src_shiftx;
-		y = rad * sin(fi) + cap->src_shifty;
 		calc[*thread_id].rh[0] = x;
-		if(calc[*thread_id].rh[0] != calc[*thread_id].rh[0]){
-			printf("rh[0]: %lf, x:%lf, rad:%lf, fi:%lf, cos(fi):%lf, shiftx:%lf\n",
-				calc[*thread_id].rh[0],x,rad,fi,cos(fi),cap->src_shiftx);
-			exit(0);
-			}
 		calc[*thread_id].rh[1] = y;
 		calc[*thread_id].rh[2] = (double)0.0;
-		if(cap->src_sigx*cap->src_sigy < 1.e-20){ //uniform distribution over PC entrance
-			r = gsl_rng_uniform(calc[*thread_id].rn);
+		if(uniform){ //uniform distribution over PC entrance
+			r = start_uniform(&calc[*thread_id], 3);
 			rad = profile->arr[0].profil * sqrt(fabs(r));
-			r = gsl_rng_uniform(calc[*thread_id].rn);
+			r = start_uniform(&calc[*thread_id], 4);
 			fi = (double)2.*PI*fabs(r);
 			xpc = rad * cos(fi) + ra;
 			ypc = rad * sin(fi) + rb;
@@ -628,9 +2345,9 @@ void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *
 			calc[*thread_id].v[1] = ypc - y;
 			calc[*thread_id].v[2] = cap->d_source;
 			} else { //non-uniform distribution
-			r = gsl_rng_uniform(calc[*thread_id].rn);
+			r = start_uniform(&calc[*thread_id], 3);
 			calc[*thread_id].v[0] = cap->src_sigx * (1.-2.*fabs(r));
-			r = gsl_rng_uniform(calc[*thread_id].rn);
+			r = start_uniform(&calc[*thread_id], 4);
 			calc[*thread_id].v[1] = cap->src_sigy * (1.-2.*fabs(r));
 			calc[*thread_id].v[2] = 1.;
 			}
@@ -659,6 +2376,7 @@ void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *
 			printf("w_gamma: %lf, cnt: %f, %d\n",gamma, calc[*thread_id].cnt[0], *thread_id);
 			exit(0);
 			}
+		if(cap->source != NULL && cap->source->n_ang > 0) w_gamma = w_gamma * source_weight(cap->source, calc[*thread_id].v);
 		if(*icount < IMSIZE-1){
 			imstr[*icount].xsou = (float)calc[*thread_id].rh[1];
 			imstr[*icount].ysou = (float)calc[*thread_id].rh[0];
@@ -684,12 +2402,20 @@ void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *
 
 		calc[*thread_id].iesc = 0;
 		calc[*thread_id].istart++; //photon was started for simulation
+		if(calc[*thread_id].qmc != NULL) calc[*thread_id].qstart[calc[*thread_id].qmc_rep]++;
+		calc[*thread_id].n_u = 0; //retries are pseudo-random
 		dx = sqrt( (calc[*thread_id].rh[0]-ra)*(calc[*thread_id].rh[0]-ra) + 
 			(calc[*thread_id].rh[1]-rb)*(calc[*thread_id].rh[1]-rb));
 		} /*end of while(dx > profile->arr[0].profil)*/
 
 	calc[*thread_id].ienter++; //photon entered the PC
-	for(i=0; i<= absmu->n_energy;i++){
+	if(calc[*thread_id].chan_map != NULL){
+		calc[*thread_id].chan = calc[*thread_id].chan_map->off[ix_cap+calc[*thread_id].chan_map->n] + iy_cap-calc[*thread_id].chan_map->lo[ix_cap+calc[*thread_id].chan_map->n];
+		calc[*thread_id].chan_map->rec[calc[*thread_id].chan*NCHAN_REC] += 1.;
+		}
+	calc[*thread_id].n_bounce = 0;
+	calc[*thread_id].w_gamma = (float)w_gamma;
+	for(i=0; i<= n_energy;i++){
 		calc[*thread_id].w[i] = calc[*thread_id].w[i] * (float)w_gamma;
 		if(calc[*thread_id].w[i] != calc[*thread_id].w[i]){
 			printf("thread:%d, w[%d]:%f,w_gamma:%lf,(float)w_gamma:%f\n",
@@ -701,7 +2427,7 @@ void start(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *
 	return;
 	}
 // ---------------------------------------------------------------------------------------------------
-void capil(struct mumc *absmu, struct cap_profile *profile, struct inp_file *cap, struct leakstruct *leaks, struct calcstruct *calc, int *thread_id)
+static inline void capil(struct mumc *absmu, struct cap_profile *profile, struct inp_file *cap, struct leakstruct *leaks, struct calcstruct *calc, int *thread_id, const int flags)
 	{
 	long i;
 	double s0[3], s1[3]; //selected capillary axis coordinates
@@ -713,146 +2439,2620 @@ void capil(struct mumc *absmu, struct cap_profile *profile, struct inp_file *cap
 	double ds; //distance between interactions
 	float w0, w1;
 	double salf2; //2* sin(alf) with alf=interaction angle
+	const int i_end = ((flags & K_GENERIC) && calc[*thread_id].zcache != NULL && calc[*thread_id].zcache->fptr != NULL) ? calc[*thread_id].zcache->i_plane : profile->nmax; //last profile point searched
 
 	calc[*thread_id].iesc = 0;
-	if(calc[*thread_id].i_refl == 0) calc[*thread_id].ix = 0;
 
 	//intersection
-	for(i=calc[*thread_id].ix+1; i<=profile->nmax; i++){
-		s0[0] = calc[*thread_id].sx[i-1];
-		s0[1] = calc[*thread_id].sy[i-1];
-		s0[2] = profile->arr[i-1].zarr;
-		s1[0] = calc[*thread_id].sx[i];
-		s1[1] = calc[*thread_id].sy[i];
-		s1[2] = profile->arr[i].zarr;
-		rad0 = profile->arr[i-1].profil;
-		rad1 = profile->arr[i].profil;
+	if(profile->shape != NULL){
 		rh1[0] = calc[*thread_id].rh[0];
 		rh1[1] = calc[*thread_id].rh[1];
 		rh1[2] = calc[*thread_id].rh[2] - cap->d_source;
-		calc[*thread_id].iesc = segment(s0,s1,rad0,rad1,rh1,calc[*thread_id].v,rn,&calf);
+		calc[*thread_id].iesc = shape_intersect(profile->shape,calc[*thread_id].chan_x,calc[*thread_id].chan_y,rh1,calc[*thread_id].v,rn,&calf);
+		//absorption profile interval of the intersection
 		if(calc[*thread_id].iesc == 0){
-			calc[*thread_id].ix = i-1;
-			break; //break out of for loop and store previous i in calc[*thread_id].ix
+			calc[*thread_id].ix = (int)floor(rh1[2]/profile->cl*profile->nmax);
+			if(calc[*thread_id].ix >= profile->nmax) calc[*thread_id].ix = profile->nmax-1;
+			if(calc[*thread_id].ix < 0) calc[*thread_id].ix = 0;
+			}
+		} else {
+		for(i=calc[*thread_id].ix+1; i<=i_end; i++){
+			s0[0] = calc[*thread_id].sx[i-1];
+			s0[1] = calc[*thread_id].sy[i-1];
+			s0[2] = profile->arr[i-1].zarr;
+			s1[0] = calc[*thread_id].sx[i];
+			s1[1] = calc[*thread_id].sy[i];
+			s1[2] = profile->arr[i].zarr;
+			rad0 = profile->arr[i-1].profil;
+			rad1 = profile->arr[i].profil;
+			rh1[0] = calc[*thread_id].rh[0];
+			rh1[1] = calc[*thread_id].rh[1];
+			rh1[2] = calc[*thread_id].rh[2] - cap->d_source;
+			calc[*thread_id].iesc = segment(s0,s1,rad0,rad1,rh1,calc[*thread_id].v,rn,&calf);
+			if(calc[*thread_id].iesc == 0){
+				calc[*thread_id].ix = i-1;
+				break; //break out of for loop and store previous i in calc[*thread_id].ix
+				}
+			}
+		}
+
+
+	if(calc[*thread_id].iesc !=0){
+		calc[*thread_id].iesc = 1;
+		if((flags & K_GENERIC) && calc[*thread_id].zcache != NULL && calc[*thread_id].zcache->fptr != NULL) calc[*thread_id].iesc = 2; //reached the cache plane
+		}
+		else //calc[*thread_id].iesc == 0
+		{
+		delta_traj[0] = rh1[0] - calc[*thread_id].rh[0];
+		delta_traj[1] = rh1[1] - calc[*thread_id].rh[1];
+		delta_traj[2] = rh1[2] + cap->d_source - calc[*thread_id].rh[2];
+		ds = sqrt(scalar(delta_traj,delta_traj));
+		calc[*thread_id].traj_length = calc[*thread_id].traj_length + ds;
+		//store new interaction coordinates in appropriate array
+		calc[*thread_id].rh[0] = rh1[0];
+		calc[*thread_id].rh[1] = rh1[1];
+		calc[*thread_id].rh[2] = rh1[2] + cap->d_source;
+		if(calc[*thread_id].wave != NULL) wave_normal(calc[*thread_id].wave, calc[*thread_id].wave_field, rh1[2], calc[*thread_id].v, rn, &calf);
+
+		if(fabs(calf) > 1.0){
+			printf("COS(alfa) > 1\n");
+			calc[*thread_id].iesc = -1;
+			}
+			else
+			{
+			alf = acos(calf);
+			alf = PI/(double)2 - alf;
+			w0 = calc[*thread_id].w[0];
+
+			calc[*thread_id].iesc = reflect(alf,cap,absmu,profile,leaks,calc,thread_id,flags);
+
+			if(calc[*thread_id].iesc != -2){
+				w1 = calc[*thread_id].w[0];
+				calc[*thread_id].absorb[calc[*thread_id].ix] = calc[*thread_id].absorb[calc[*thread_id].ix] + (double)(w0-w1);
+				if(calc[*thread_id].chan_map != NULL) calc[*thread_id].chan_map->rec[calc[*thread_id].chan*NCHAN_REC+3] += w0-w1;
+
+				salf2 = (double)2.*sin(alf);
+				calc[*thread_id].v[0] = calc[*thread_id].v[0] - salf2*rn[0];
+				calc[*thread_id].v[1] = calc[*thread_id].v[1] - salf2*rn[1];
+				calc[*thread_id].v[2] = calc[*thread_id].v[2] - salf2*rn[2];
+
+				norm(calc[*thread_id].v, (int)3);
+				calc[*thread_id].i_refl++; //add a reflection
+				}
+			}
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+static inline void count(struct mumc *absmu, struct inp_file *cap, int *icount, struct cap_profile *profile, struct leakstruct *leaks, struct image_struct *imstr, struct calcstruct *calc, int *thread_id, const int flags)
+	{
+	const int spots = (flags & K_GENERIC) ? cap->spots : (flags & K_SPOTS) != 0;
+	const int n_energy = absmu->n_energy;
+	int i;
+	double cc; //distance between last interaction and capillary exit, divided by propagation vector in z
+	double xpend, ypend; //coordinates of photon at end of capillary if rendered unobstructed
+	float v_hex1[2], v_hex2[2], v_hex3[2]; //normal vectors of edges of hexagonal PC shape
+	float hex_edge_dist; //distance from PC centre to middle of hex edge (along normal on edge)
+	float dp1, dp2, dp3; //length of xpend and ypend projected on hex edge norm
+	double c; //distance between last interaction and screen position, divided by propagation vector in z
+	float xp, yp; //photon position on screen if rendered unobstructed
+	double delta_traj[3]; //photon trajectory from last interaction to screen
+	double ds; //distance between last interaction and screen
+	double *sbin[NSYM]; //spot bins where photon (and its symmetric images) hits screen
+	double *zsbin[NSCREEN][NSYM]; //idem for the additional screens
+	float w_sym; //weight of each image
+	double cz; //distance between last interaction and additional screen, divided by propagation vector in z
+	int k, l;
+	double *chan_rec = NULL; //channel map accumulators of the photon's channel
+
+	if(calc[*thread_id].chan_map != NULL){
+		chan_rec = &calc[*thread_id].chan_map->rec[calc[*thread_id].chan*NCHAN_REC];
+		chan_rec[1] += 1.;
+		chan_rec[2] += calc[*thread_id].i_refl;
+		}
+
+	//simulate hexagonal polycapillary housing
+	cc = ((cap->d_source+profile->cl)-calc[*thread_id].rh[2])/calc[*thread_id].v[2];
+	xpend  = calc[*thread_id].rh[0] + cc*calc[*thread_id].v[0];
+	ypend  = calc[*thread_id].rh[1] + cc*calc[*thread_id].v[1];
+	v_hex1[0] = 0; //vert hex edges x vector
+	v_hex1[1] = 1; //vert hex edges y vector
+	v_hex2[0] = cos(PI/6); //upper right and lower left edges x vector
+	v_hex2[1] = sin(PI/6); //upper right and lower left edges y vector
+	v_hex3[0] = cos(-1.*PI/6); //upper left and lower right edges x vector
+	v_hex3[1] = sin(-1.*PI/6); //upper left and lower right edges y vector
+	hex_edge_dist = sqrt(profile->rtot2 * profile->rtot2 - (profile->rtot2/2)*(profile->rtot2/2));
+	//calculate dot products and see if magnitude is > distance from centre to hex side
+	dp1 = fabs(v_hex1[0]*xpend + v_hex1[1]*ypend);
+	dp2 = fabs(v_hex2[0]*xpend + v_hex2[1]*ypend);
+	dp3 = fabs(v_hex3[0]*xpend + v_hex3[1]*ypend);
+	if(dp1 > hex_edge_dist || dp2 > hex_edge_dist || dp3 > hex_edge_dist){
+		//photon is outside of PC exit area
+		calc[*thread_id].iesc = -3;
+		}
+		else //photon inside PC exit area
+		{
+		c = (cap->d_screen - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
+		xp = (float)(calc[*thread_id].rh[0] + c*calc[*thread_id].v[0]);
+		yp = (float)(calc[*thread_id].rh[1] + c*calc[*thread_id].v[1]);
+
+		if(spots){
+			spot_bin_images(leaks->spot, xp, yp, cap->n_sym, sbin);
+			for(k=0; k<cap->n_screen; k++){
+				cz = (cap->z_screens[k] - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
+				spot_bin_images(leaks->zspot[k], calc[*thread_id].rh[0] + cz*calc[*thread_id].v[0],
+					calc[*thread_id].rh[1] + cz*calc[*thread_id].v[1], cap->n_sym, zsbin[k]);
+				}
 			}
+		w_sym = (float)1./cap->n_sym;
+		for(i=0; i <= n_energy; i++){
+			calc[*thread_id].cnt[i] = calc[*thread_id].cnt[i] + calc[*thread_id].w[i];
+			if(calc[*thread_id].cnt[i] != calc[*thread_id].cnt[i]){
+				printf("thread: %d, icount: %d, cnt[%d]: %f, w[%d]: %f\n",
+					*thread_id,*icount,i,calc[*thread_id].cnt[i],i,calc[*thread_id].w[i]);
+				exit(0);
+				}
+			if(spots && absmu->arr[i].layer >= 0){
+				for(l=0; l<cap->n_sym; l++){
+					if(sbin[l] != NULL) sbin[l][absmu->arr[i].layer] += calc[*thread_id].w[i]*w_sym;
+					for(k=0; k<cap->n_screen; k++) if(zsbin[k][l] != NULL) zsbin[k][l][absmu->arr[i].layer] += calc[*thread_id].w[i]*w_sym;
+					}
+				}
+			} //for(i=0; i <= n_energy; i++)
+		if(calc[*thread_id].qmc != NULL){
+			for(i=0; i <= absmu->n_energy; i++) calc[*thread_id].qcnt[calc[*thread_id].qmc_rep*(absmu->n_energy+1)+i] += calc[*thread_id].w[i];
+			}
+		if(chan_rec != NULL){
+			for(i=0; i <= absmu->n_energy; i++) chan_rec[4+calc[*thread_id].chan_map->band[i]] += calc[*thread_id].w[i]*calc[*thread_id].chan_map->band_w[i];
+			}
+		if(calc[*thread_id].exitw != NULL) exitw_add_photon(&calc[*thread_id], absmu->n_energy, xp, yp);
+		stats_add(leaks, n_energy, xp, yp, calc[*thread_id].v, calc[*thread_id].w);
+		calc[*thread_id].itrans++;
+
+		delta_traj[0] = c*calc[*thread_id].v[0];
+		delta_traj[1] = c*calc[*thread_id].v[1];
+		delta_traj[2] = c*calc[*thread_id].v[2];
+		ds = sqrt(scalar(delta_traj,delta_traj));
+		calc[*thread_id].traj_length = calc[*thread_id].traj_length + ds;
+
+		if(*icount <= IMSIZE-1){
+			imstr[*icount].xm = yp;
+			imstr[*icount].ym = xp;
+			imstr[*icount].xm1 = (float)calc[*thread_id].v[1];
+			imstr[*icount].ym1 = (float)calc[*thread_id].v[0];
+			imstr[*icount].warr = calc[*thread_id].w[0];
+			}
+		} //if(dp1 > hex_edge_dist || dp2 > hex_edge_dist || dp3 > hex_edge_dist) ... else ...
+	if(calc[*thread_id].hist != NULL) hist_end_photon(&calc[*thread_id], calc[*thread_id].iesc == -3 ? 0 : 1);
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Trace one photon from the source until it is counted on the screen, restarting it when it does not
+// enter a capillary or is absorbed. flags (K_*) is a compile time constant in each kernel below.
+static inline void trace_kernel(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id, const int flags)
+	{
+	do{
+		do{
+			start(absmu, profile, pcap_ini, cap, icount, imstr, calc, thread_id, flags);
+			do{
+				capil(absmu, profile, cap, calc[*thread_id].leaks, calc, thread_id, flags);
+				} while(calc[*thread_id].iesc == 0);
+			} while(calc[*thread_id].iesc == -2);
+		count(absmu, cap, icount, profile, calc[*thread_id].leaks, imstr, calc, thread_id, flags);
+		} while(calc[*thread_id].iesc == -3);
+
+	return;
+	}
+
+typedef void (*trace_func)(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id);
+
+#define TRACE_KERNEL(name, flags) \
+static void name(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id) \
+	{ \
+	trace_kernel(absmu, profile, pcap_ini, cap, icount, imstr, calc, thread_id, flags); \
+	}
+TRACE_KERNEL(trace_generic, K_GENERIC)
+TRACE_KERNEL(trace_nospot, 0)
+TRACE_KERNEL(trace_spots, K_SPOTS)
+
+// ---------------------------------------------------------------------------------------------------
+// Select the tracing kernel specialised for the spot output of this run; the kernel flags are returned
+// in flags
+trace_func select_kernel(struct run_opts *opts, int *flags)
+	{
+	if(opts->generic){
+		*flags = K_GENERIC;
+		return trace_generic;
+		}
+	*flags = opts->nospot ? 0 : K_SPOTS;
+
+	return (*flags & K_SPOTS) ? trace_spots : trace_nospot;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Allocate an empty transport response table, tabulating incidence angles up to REFL_MAX critical
+// angles of the lowest energy plus the angle under which the channel entrance is seen over its length
+struct resp_table *resp_alloc(struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu)
+	{
+	struct resp_table *resp = malloc(sizeof(struct resp_table));
+	int n_cell = NRESP_RING*NRESP_ANG*NRESP_PSI;
+
+	if(resp == NULL){
+		printf("Could not allocate response table memory.\n");
+		exit(0);
+		}
+	resp->n_energy = absmu->n_energy;
+	resp->ang_max = REFL_MAX*crit_angle(cap, absmu, 0) + 2.*profile->arr[0].profil/profile->cl;
+	resp->n = calloc(n_cell,sizeof(double));
+	resp->trans = calloc(n_cell*(absmu->n_energy+1),sizeof(double));
+	resp->mom = calloc(n_cell*NRESP_MOM,sizeof(double));
+	if(resp->n == NULL || resp->trans == NULL || resp->mom == NULL){
+		printf("Could not allocate response table memory.\n");
+		exit(0);
+		}
+
+	return resp;
+	}
+// ---------------------------------------------------------------------------------------------------
+void resp_free(struct resp_table *resp)
+	{
+	free(resp->n);
+	free(resp->trans);
+	free(resp->mom);
+	free(resp);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Add response table src to dst (reduction of the per-thread tables)
+void resp_merge(struct resp_table *dst, struct resp_table *src)
+	{
+	int i, n_cell = NRESP_RING*NRESP_ANG*NRESP_PSI;
+
+	for(i=0; i<n_cell; i++) dst->n[i] += src->n[i];
+	for(i=0; i<n_cell*(dst->n_energy+1); i++) dst->trans[i] += src->trans[i];
+	for(i=0; i<n_cell*NRESP_MOM; i++) dst->mom[i] += src->mom[i];
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write a response table together with the energies, glass, walls and capillary profile it is valid for
+void resp_write(char *filename, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu, struct resp_table *resp)
+	{
+	FILE *fptr;
+	int i, header[4], n_cell = NRESP_RING*NRESP_ANG*NRESP_PSI;
+
+	fptr = fopen(filename,"wb");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	header[0] = resp->n_energy;
+	header[1] = NRESP_RING;
+	header[2] = NRESP_ANG;
+	header[3] = NRESP_PSI;
+	fwrite(RESP_MAGIC,sizeof(char),sizeof(RESP_MAGIC),fptr);
+	fwrite(header,sizeof(int),4,fptr);
+	fwrite(&cap->e_start,sizeof(float),1,fptr);
+	fwrite(&cap->delta_e,sizeof(float),1,fptr);
+	fwrite(&profile->cl,sizeof(double),1,fptr);
+	fwrite(&profile->rtot1,sizeof(double),1,fptr);
+	fwrite(&profile->rtot2,sizeof(double),1,fptr);
+	//the glass, the walls and the whole profile the table holds for
+	fwrite(&cap->sig_rough,sizeof(double),1,fptr);
+	fwrite(&cap->sig_wave,sizeof(double),1,fptr);
+	fwrite(&cap->corr_length,sizeof(double),1,fptr);
+	fwrite(&cap->density,sizeof(float),1,fptr);
+	for(i=0; i<=absmu->n_energy; i++){
+		fwrite(&absmu->arr[i].amu,sizeof(float),1,fptr);
+		fwrite(&absmu->arr[i].scatf,sizeof(double),1,fptr);
+		}
+	fwrite(&profile->nmax,sizeof(int),1,fptr);
+	for(i=0; i<=profile->nmax; i++){
+		fwrite(&profile->arr[i].zarr,sizeof(double),1,fptr);
+		fwrite(&profile->arr[i].profil,sizeof(double),1,fptr);
+		fwrite(&profile->arr[i].d_arr,sizeof(double),1,fptr);
+		}
+	fwrite(&resp->ang_max,sizeof(double),1,fptr);
+	fwrite(resp->n,sizeof(double),n_cell,fptr);
+	fwrite(resp->trans,sizeof(double),n_cell*(resp->n_energy+1),fptr);
+	fwrite(resp->mom,sizeof(double),n_cell*NRESP_MOM,fptr);
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a response table, which should have been recorded for the energies and capillary geometry of cap
+struct resp_table *resp_read(char *filename, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu)
+	{
+	FILE *fptr;
+	int i, nmax, same, header[4], n_cell = NRESP_RING*NRESP_ANG*NRESP_PSI;
+	char magic[sizeof(RESP_MAGIC)];
+	float e_start, delta_e, density, amu;
+	double cl, rtot1, rtot2, sig_rough, sig_wave, corr_length, scatf, zarr, profil, d_arr;
+	struct resp_table *resp;
+
+	fptr = fopen(filename,"rb");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	if(fread(magic,sizeof(char),sizeof(RESP_MAGIC),fptr) != sizeof(RESP_MAGIC) || strcmp(magic,RESP_MAGIC) != 0 ||
+	   fread(header,sizeof(int),4,fptr) != 4 || fread(&e_start,sizeof(float),1,fptr) != 1 || fread(&delta_e,sizeof(float),1,fptr) != 1 ||
+	   fread(&cl,sizeof(double),1,fptr) != 1 || fread(&rtot1,sizeof(double),1,fptr) != 1 || fread(&rtot2,sizeof(double),1,fptr) != 1){
+		printf("%s is not a polycap response table file.\n",filename);
+		exit(0);
+		}
+	if(header[0] != absmu->n_energy || header[1] != NRESP_RING || header[2] != NRESP_ANG || header[3] != NRESP_PSI ||
+	   e_start != cap->e_start || delta_e != cap->delta_e){
+		printf("Response table %s was recorded for different energies.\n",filename);
+		exit(0);
+		}
+	if(fabs(cl-profile->cl) > DELTA || fabs(rtot1-profile->rtot1) > DELTA || fabs(rtot2-profile->rtot2) > DELTA){
+		printf("Response table %s was recorded with a different capillary geometry.\n",filename);
+		exit(0);
+		}
+	fread(&sig_rough,sizeof(double),1,fptr);
+	fread(&sig_wave,sizeof(double),1,fptr);
+	fread(&corr_length,sizeof(double),1,fptr);
+	fread(&density,sizeof(float),1,fptr);
+	same = sig_rough == cap->sig_rough && sig_wave == cap->sig_wave && corr_length == cap->corr_length && density == cap->density;
+	for(i=0; i<=absmu->n_energy; i++){
+		fread(&amu,sizeof(float),1,fptr);
+		fread(&scatf,sizeof(double),1,fptr);
+		if(amu != absmu->arr[i].amu || scatf != absmu->arr[i].scatf) same = 0;
+		}
+	if(same == 0){
+		printf("Response table %s was recorded for a different glass, roughness or waviness.\n",filename);
+		exit(0);
+		}
+	if(fread(&nmax,sizeof(int),1,fptr) != 1){
+		printf("Response table %s is truncated.\n",filename);
+		exit(0);
+		}
+	same = nmax == profile->nmax;
+	for(i=0; same && i<=nmax; i++){
+		fread(&zarr,sizeof(double),1,fptr);
+		fread(&profil,sizeof(double),1,fptr);
+		fread(&d_arr,sizeof(double),1,fptr);
+		if(zarr != profile->arr[i].zarr || profil != profile->arr[i].profil || d_arr != profile->arr[i].d_arr) same = 0;
+		}
+	if(same == 0){
+		printf("Response table %s was recorded with a different capillary geometry.\n",filename);
+		exit(0);
+		}
+	resp = resp_alloc(cap, profile, absmu);
+	if(fread(&resp->ang_max,sizeof(double),1,fptr) != 1 || fread(resp->n,sizeof(double),n_cell,fptr) != n_cell ||
+	   fread(resp->trans,sizeof(double),n_cell*(resp->n_energy+1),fptr) != n_cell*(resp->n_energy+1) ||
+	   fread(resp->mom,sizeof(double),n_cell*NRESP_MOM,fptr) != n_cell*NRESP_MOM){
+		printf("Response table %s is truncated.\n",filename);
+		exit(0);
+		}
+	fclose(fptr);
+
+	return resp;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Local frame of the channel selected by start(): axis direction a at the entrance, and the radial (er)
+// and tangential (et) unit vectors of the channel azimuth in the transverse plane
+void chan_frame(struct cap_profile *profile, struct calcstruct *calc, double *a, double *er, double *et)
+	{
+	double cx, slope;
+
+	cx = sqrt(calc->chan_x*calc->chan_x + calc->chan_y*calc->chan_y);
+	if(cx <= DELTA){
+		er[0] = 1.;
+		er[1] = 0.;
+		} else {
+		er[0] = calc->chan_x/cx;
+		er[1] = calc->chan_y/cx;
+		}
+	er[2] = 0.;
+	et[0] = -er[1];
+	et[1] = er[0];
+	et[2] = 0.;
+	slope = (profile->arr[1].d_arr-profile->arr[0].d_arr)/(profile->arr[1].zarr-profile->arr[0].zarr);
+	a[0] = calc->chan_x*slope;
+	a[1] = calc->chan_y*slope;
+	a[2] = 1.;
+	norm(a, 3);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Response table cell of ring, incidence angle theta to the channel axis and azimuth psi (0 - 2 PI)
+// to the radial plane; the fraction of the way to the next angle bin centre is stored in f.
+// Angle bin edges are at ang_max*(k/NRESP_ANG)^2, fine enough near normal incidence for far sources.
+int resp_cell(struct resp_table *resp, double cx, double theta, double psi, double *f)
+	{
+	int ir, ia, ip;
+	double fa;
+
+	ir = (int)(cx*NRESP_RING);
+	if(ir >= NRESP_RING) ir = NRESP_RING-1;
+	if(psi > PI) psi = 2.*PI-psi; //mirror symmetry in the radial plane
+	ip = (int)(psi/PI*NRESP_PSI);
+	if(ip >= NRESP_PSI) ip = NRESP_PSI-1;
+	fa = sqrt(theta/resp->ang_max)*NRESP_ANG;
+	ia = (int)fa;
+	if(ia >= NRESP_ANG) ia = NRESP_ANG-1;
+	*f = fa-ia-0.5;
+
+	return (ir*NRESP_ANG + ia)*NRESP_PSI + ip;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Response table recording: re-aim the photon start() sent into a channel at a uniformly distributed
+// entrance point and azimuth, with an incidence angle spread evenly over the angle bins, then trace it
+// through the channel
+void trace_record(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+	{
+	int i, cell;
+	double a[3], er[3], et[3];
+	double rad, fi, theta, psi, f, cx;
+	double r, t; //exit direction angles to the optical axis, radial and tangential [rad]
+	struct calcstruct *c = &calc[*thread_id];
+	struct resp_table *resp = c->resp;
+
+	start(absmu, profile, pcap_ini, cap, icount, imstr, calc, thread_id, K_GENERIC);
+	chan_frame(profile, c, a, er, et);
+	rad = profile->arr[0].profil * sqrt(gsl_rng_uniform(c->rn));
+	fi = 2.*PI*gsl_rng_uniform(c->rn);
+	c->rh[0] = c->chan_x*profile->rtot1 + rad*cos(fi);
+	c->rh[1] = c->chan_y*profile->rtot1 + rad*sin(fi);
+	c->rh[2] = cap->d_source;
+	theta = gsl_rng_uniform(c->rn);
+	theta = resp->ang_max*theta*theta;
+	psi = 2.*PI*gsl_rng_uniform(c->rn);
+	for(i=0; i<3; i++) c->v[i] = cos(theta)*a[i] + sin(theta)*(cos(psi)*er[i] + sin(psi)*et[i]);
+	norm(c->v, 3);
+	for(i=0; i<=absmu->n_energy; i++) c->w[i] = (float)1;
+	cx = sqrt(c->chan_x*c->chan_x + c->chan_y*c->chan_y);
+	cell = resp_cell(resp, cx, theta, psi, &f);
+	resp->n[cell] += 1.;
+
+	do{
+		capil(absmu, profile, cap, c->leaks, calc, thread_id, K_GENERIC);
+		} while(c->iesc == 0);
+	if(c->iesc != 1) return;
+
+	for(i=0; i<=absmu->n_energy; i++) resp->trans[cell*(absmu->n_energy+1)+i] += c->w[i];
+	r = (c->v[0]*er[0] + c->v[1]*er[1])/c->v[2];
+	t = (c->v[0]*et[0] + c->v[1]*et[1])/c->v[2];
+	resp->mom[cell*NRESP_MOM] += c->w[0]*r;
+	resp->mom[cell*NRESP_MOM+1] += c->w[0]*t;
+	resp->mom[cell*NRESP_MOM+2] += c->w[0]*r*r;
+	resp->mom[cell*NRESP_MOM+3] += c->w[0]*t*t;
+	resp->mom[cell*NRESP_MOM+4] += c->w[0]*r*t;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Response table evaluation: start a photon from the source of cap as in a traced run, and instead of
+// tracing it look up its transmission and exit direction moments, interpolated in incidence angle.
+// Adds to the transmitted weight and the exit statistics as count() would.
+void trace_lookup(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+	{
+	int i, k, cell, cell2;
+	double a[3], er[3], et[3], vl[3];
+	double theta, psi, f, cx, rate, rate0, w, d;
+	double m[NRESP_MOM]; //exit direction moments per unit of transmitted weight
+	double cphi, sphi, dx, dy, dx2, dy2, xe, ye, *mom;
+	struct calcstruct *c = &calc[*thread_id];
+	struct resp_table *resp = c->resp;
+
+	start(absmu, profile, pcap_ini, cap, icount, imstr, calc, thread_id, K_GENERIC);
+	chan_frame(profile, c, a, er, et);
+	theta = acos(fmin(scalar(c->v,a),1.));
+	if(theta >= resp->ang_max) return; //not transmitted
+	for(i=0; i<3; i++) vl[i] = c->v[i] - cos(theta)*a[i];
+	psi = atan2(scalar(vl,et),scalar(vl,er));
+	if(psi < 0.) psi += 2.*PI;
+	cx = sqrt(c->chan_x*c->chan_x + c->chan_y*c->chan_y);
+	cell = resp_cell(resp, cx, theta, psi, &f);
+	//linear interpolation between the angle bin centres
+	cell2 = cell;
+	if(f < 0. && cell/NRESP_PSI % NRESP_ANG > 0) cell2 = cell-NRESP_PSI;
+	if(f > 0. && cell/NRESP_PSI % NRESP_ANG < NRESP_ANG-1) cell2 = cell+NRESP_PSI;
+	f = fabs(f);
+	if(resp->n[cell] <= 0.) return;
+	if(resp->n[cell2] <= 0.) cell2 = cell;
+
+	rate0 = (1.-f)*resp->trans[cell*(resp->n_energy+1)]/resp->n[cell] + f*resp->trans[cell2*(resp->n_energy+1)]/resp->n[cell2];
+	for(k=0; k<NRESP_MOM; k++){
+		m[k] = 0.;
+		if(rate0 > 0.) m[k] = ((1.-f)*resp->mom[cell*NRESP_MOM+k]/resp->n[cell] + f*resp->mom[cell2*NRESP_MOM+k]/resp->n[cell2])/rate0;
+		}
+	cphi = er[0];
+	sphi = er[1];
+	dx = m[0]*cphi - m[1]*sphi;
+	dy = m[0]*sphi + m[1]*cphi;
+	dx2 = m[2]*cphi*cphi - 2.*m[4]*cphi*sphi + m[3]*sphi*sphi;
+	dy2 = m[2]*sphi*sphi + 2.*m[4]*cphi*sphi + m[3]*cphi*cphi;
+	//screen position from the channel exit along the exit direction
+	xe = c->chan_x*profile->rtot2;
+	ye = c->chan_y*profile->rtot2;
+	d = cap->d_screen - cap->d_source - profile->cl;
+	for(i=0; i<=absmu->n_energy; i++){
+		rate = (1.-f)*resp->trans[cell*(resp->n_energy+1)+i]/resp->n[cell] + f*resp->trans[cell2*(resp->n_energy+1)+i]/resp->n[cell2];
+		w = c->w[i]*rate;
+		c->cnt[i] = c->cnt[i] + w;
+		mom = &c->leaks->mom[i*NSTAT_MOM];
+		mom[0] += w;
+		mom[1] += w*(xe + d*dx);
+		mom[2] += w*(ye + d*dy);
+		mom[3] += w*(xe*xe + 2.*xe*d*dx + d*d*dx2);
+		mom[4] += w*(ye*ye + 2.*ye*d*dy + d*d*dy2);
+		mom[5] += w*dx;
+		mom[6] += w*dy;
+		mom[7] += w*dx2;
+		mom[8] += w*dy2;
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write one layer of a spot map (photon intensity on screen) to file, as a grid of nbin*nbin bins
+// centered on the polycapillary axis. Layer -1 writes the sum of all layers.
+void write_spot(char *filename, struct spot_map *map, int nbin, int layer)
+	{
+	FILE *fptr;
+	int i, j, k;
+	double sum;
+
+	fptr = fopen(filename,"w");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	fprintf(fptr,"%d\t%d\n",nbin,nbin);
+	for(j=0; j<nbin; j++){
+		for(i=0; i<nbin; i++){
+			if(layer >= 0) sum = spot_get(map,i-nbin/2,j-nbin/2,layer);
+				else for(k=0, sum=0.; k<map->nlayer; k++) sum += spot_get(map,i-nbin/2,j-nbin/2,k);
+			fprintf(fptr,"%f\t",sum);
+			}
+		fprintf(fptr,"\n");
+		}
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write all energy layers of a spot map to file: grid size and number of layers, followed by
+// the energy range [keV] and nbin*nbin grid of each layer
+void write_spot_cube(char *filename, struct spot_map *map, int nbin, struct inp_file *cap, struct mumc *absmu)
+	{
+	FILE *fptr;
+	int i, j, k;
+	float e_lo, e_hi;
+
+	fptr = fopen(filename,"w");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	fprintf(fptr,"%d\t%d\t%d\n",nbin,nbin,map->nlayer);
+	for(k=0; k<map->nlayer; k++){
+		e_lo = -1.;
+		e_hi = -1.;
+		for(i=0; i<=absmu->n_energy; i++){
+			if(absmu->arr[i].layer != k) continue;
+			if(e_lo < 0.) e_lo = cap->e_start+i*cap->delta_e;
+			e_hi = cap->e_start+i*cap->delta_e;
+			}
+		fprintf(fptr,"%8.2f\t%8.2f\n",e_lo,e_hi); //-1 for a layer without energies
+		for(j=0; j<nbin; j++){
+			for(i=0; i<nbin; i++){
+				fprintf(fptr,"%f\t",spot_get(map,i-nbin/2,j-nbin/2,k));
+				}
+			fprintf(fptr,"\n");
+			}
+		}
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the spot maps of transmitted (spot.dat) and leaked (lspot.dat) photons, of the lowest energy
+// or, if that is not binned, summed over the binned energies, plus the energy resolved spot maps.
+// The additional screens get the same files with the screen distance appended (spot_z<d_screen>.dat).
+void write_spot_files(struct inp_file *cap, struct mumc *absmu, struct leakstruct *leaks, int nspot)
+	{
+	int i;
+	char f_spot[100];
+
+	write_spot("spot.dat",leaks->spot,nspot,absmu->arr[0].layer);
+	write_spot("lspot.dat",leaks->lspot,nspot,absmu->arr[0].layer);
+	if(absmu->n_layer > 1){
+		write_spot_cube("spot_e.dat",leaks->spot,nspot,cap,absmu);
+		write_spot_cube("lspot_e.dat",leaks->lspot,nspot,cap,absmu);
+		}
+	for(i=0; i<cap->n_screen; i++){
+		sprintf(f_spot,"spot_z%g.dat",cap->d_screens[i]);
+		write_spot(f_spot,leaks->zspot[i],nspot,absmu->arr[0].layer);
+		sprintf(f_spot,"lspot_z%g.dat",cap->d_screens[i]);
+		write_spot(f_spot,leaks->zlspot[i],nspot,absmu->arr[0].layer);
+		if(absmu->n_layer > 1){
+			sprintf(f_spot,"spot_e_z%g.dat",cap->d_screens[i]);
+			write_spot_cube(f_spot,leaks->zspot[i],nspot,cap,absmu);
+			sprintf(f_spot,"lspot_e_z%g.dat",cap->d_screens[i]);
+			write_spot_cube(f_spot,leaks->zlspot[i],nspot,cap,absmu);
+			}
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the transmission efficiency per energy (*.out file) and absorption profile (*.out.abs file)
+void write_out(char *inp_name, struct inp_file *cap, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct mumc *absmu, struct leakstruct *leaks, double *sum_cnt, double *absorb_sum, long sum_istart, long sum_ienter, double ave_refl)
+	{
+	FILE *fptr;
+	int i;
+	char f_abs[100];
+
+	fptr = fopen(cap->out,"w");
+	if(fptr == NULL){
+		printf("Trouble with output...\n");
+		exit(0);
+		}
+	fprintf(fptr,"Surface roughness [Angstrom]:\t %f\n",cap->sig_rough);
+	fprintf(fptr,"Amplitude of Waviness [cm]:\t %f\n",cap->sig_wave);
+	fprintf(fptr,"Waviness corr. length [cm]:\t %f\n",cap->corr_length);
+	fprintf(fptr,"Source distance [cm]:\t\t %f\n",cap->d_source);
+	fprintf(fptr,"Screen distance [cm]:\t\t %f\n",cap->d_screen);
+	fprintf(fptr,"Source diameter [cm]:\t\t %f\n",cap->src_x*2.);
+	fprintf(fptr,"Capillary foc. distances [cm]:\t %f\t%f\n",cap->src_sigx,cap->src_sigy);//this is not what's written here...
+	fprintf(fptr,"Number of channels:\t\t %5.0f\n",cap->n_chan);
+	fprintf(fptr,"Calculated capillary open area:\t %5.3f\n",pcap_ini->eta);
+	fprintf(fptr,"Misalignment rotation [rad]/translation [cm]: %f\t%f\n",cap->src_shiftx,cap->src_shifty); //only translation
+	fprintf(fptr,"Capillary profile: %s\n",cap->prf);
+	fprintf(fptr,"Capillary axis   : %s\n",cap->axs);
+	fprintf(fptr,"External profile : %s\n",cap->ext);
+	fprintf(fptr,"Input file       : %s\n",inp_name);
+	fprintf(fptr,"  E [keV]      I/I0\n");
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%d\t%d\n",absmu->n_energy+1,5);
+	for(i=0; i<=absmu->n_energy; i++){
+		fprintf(fptr,"%8.2f\t%10.9f\t%10.9f\t%10.9f\t%10.9f\n",cap->e_start+i*cap->delta_e,
+			sum_cnt[i]/(double)sum_ienter*pcap_ini->eta, sum_cnt[i]/(double)sum_istart,
+			(double)sum_ienter/(double)sum_istart, leaks->leak[i]/(double)sum_ienter);
+		}
+	fprintf(fptr,"\nThe started photons: %ld\n",sum_istart);
+	fprintf(fptr,"\nAverage number of reflections: %f\n",ave_refl);
+	fclose(fptr);
+
+	sprintf(f_abs,"%s.abs",cap->out);
+	fptr = fopen(f_abs,"w");
+	if(fptr == NULL){
+		printf("Trouble with output...\n");
+		exit(0);
+		}
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%d\t%d\n",profile->nmax,2);
+	for(i=0;i<=profile->nmax;i++) fprintf(fptr,"%f\t%f\n",profile->arr[i].zarr,absorb_sum[i]);
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Full width at half maximum of histogram h of n bins of the given width, interpolated linearly
+// between the bins where h crosses half of its maximum; 0 for an empty histogram
+double hist_fwhm(double *h, int n, double width)
+	{
+	int i, i_max, lo, hi;
+	double half, x_lo, x_hi;
+
+	i_max = 0;
+	for(i=1; i<n; i++) if(h[i] > h[i_max]) i_max = i;
+	if(h[i_max] <= 0.) return 0.;
+	half = h[i_max]/2.;
+	for(lo=i_max; lo > 0 && h[lo-1] >= half; lo--);
+	for(hi=i_max; hi < n-1 && h[hi+1] >= half; hi++);
+	x_lo = (lo > 0) ? lo - (h[lo]-half)/(h[lo]-h[lo-1]) : 0.;
+	x_hi = (hi < n-1) ? hi + (h[hi]-half)/(h[hi]-h[hi+1]) : n-1.;
+
+	return (x_hi-x_lo)*width;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the exit beam statistics of the transmitted photons: weighted mean and standard deviation of
+// the position on screen and of the direction per energy, plus the FWHM of the spot and the divergence
+// at the lowest energy (*.out.stat file), and the exit direction histogram (ang.dat)
+void write_stats(struct inp_file *cap, struct mumc *absmu, struct leakstruct *leaks)
+	{
+	FILE *fptr;
+	int i, j, k;
+	double *mom, mean[4], sig[4];
+	double fwhm_x, fwhm_y, fwhm_dx, fwhm_dy;
+	double *angx, *angy; //projections of the direction histogram
+	char f_stat[100];
+
+	angx = calloc(NANG,sizeof(double));
+	angy = calloc(NANG,sizeof(double));
+	if(angx == NULL || angy == NULL){
+		printf("Could not allocate exit statistics memory.\n");
+		exit(0);
+		}
+	for(j=0; j<NANG; j++){
+		for(i=0; i<NANG; i++){
+			angx[i] += leaks->ang[j*NANG+i];
+			angy[j] += leaks->ang[j*NANG+i];
+			}
+		}
+	fwhm_x = hist_fwhm(leaks->posx, NSPOT, leaks->binsize);
+	fwhm_y = hist_fwhm(leaks->posy, NSPOT, leaks->binsize);
+	fwhm_dx = hist_fwhm(angx, NANG, 2.*leaks->ang_max/NANG);
+	fwhm_dy = hist_fwhm(angy, NANG, 2.*leaks->ang_max/NANG);
+
+	sprintf(f_stat,"%.90s.stat",cap->out);
+	fptr = fopen(f_stat,"w");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",f_stat);
+		exit(0);
+		}
+	fprintf(fptr,"Screen distance [cm]:\t\t %f\n",cap->d_screen);
+	fprintf(fptr,"FWHM spot x, y [cm]:\t\t %f\t%f\n",fwhm_x,fwhm_y);
+	fprintf(fptr,"FWHM divergence x, y [rad]:\t %f\t%f\n",fwhm_dx,fwhm_dy);
+	fprintf(fptr,"  E [keV]    I    <x> [cm]    sig x    <y> [cm]    sig y    <dx> [rad]    sig dx    <dy> [rad]    sig dy\n");
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%d\t%d\n",absmu->n_energy+1,10);
+	for(i=0; i<=absmu->n_energy; i++){
+		mom = &leaks->mom[i*NSTAT_MOM];
+		for(k=0; k<4; k++){
+			mean[k] = 0.;
+			sig[k] = 0.;
+			if(mom[0] <= 0.) continue;
+			mean[k] = mom[1+(k/2)*4+k%2]/mom[0];
+			sig[k] = mom[3+(k/2)*4+k%2]/mom[0] - mean[k]*mean[k];
+			sig[k] = (sig[k] > 0.) ? sqrt(sig[k]) : 0.;
+			}
+		fprintf(fptr,"%8.2f\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\t%g\n",cap->e_start+i*cap->delta_e,mom[0],
+			mean[0],sig[0],mean[1],sig[1],mean[2],sig[2],mean[3],sig[3]);
+		}
+	fclose(fptr);
+
+	fptr = fopen("ang.dat","w");
+	if(fptr == NULL){
+		printf("Could not open ang.dat for writing.\n");
+		exit(0);
+		}
+	fprintf(fptr,"%d\t%d\t%f\n",NANG,NANG,leaks->ang_max);
+	for(j=0; j<NANG; j++){
+		for(i=0; i<NANG; i++) fprintf(fptr,"%g\t",leaks->ang[j*NANG+i]);
+		fprintf(fptr,"\n");
+		}
+	fclose(fptr);
+	free(angx);
+	free(angy);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the transmission efficiency per energy averaged over the quasi-random replicates and its
+// standard error (*.out.qmc file)
+void write_qmc(struct inp_file *cap, struct mumc *absmu, int n_rep, double *qcnt, long *qstart)
+	{
+	FILE *fptr;
+	int i, r;
+	double eff, sum, sum2;
+	char f_qmc[100];
+
+	sprintf(f_qmc,"%.90s.qmc",cap->out);
+	fptr = fopen(f_qmc,"w");
+	if(fptr == NULL){
+		printf("Trouble with output...\n");
+		exit(0);
+		}
+	fprintf(fptr,"Quasi-random replicates: %d\n",n_rep);
+	fprintf(fptr,"  E [keV]      I/I0\t\tstd. error\n");
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%d\t%d\n",absmu->n_energy+1,3);
+	for(i=0; i<=absmu->n_energy; i++){
+		sum = 0.;
+		sum2 = 0.;
+		for(r=0; r<n_rep; r++){
+			eff = qstart[r] > 0 ? qcnt[r*(absmu->n_energy+1)+i]/(double)qstart[r] : 0.;
+			sum = sum + eff;
+			sum2 = sum2 + eff*eff;
+			}
+		sum = sum/n_rep;
+		sum2 = (sum2/n_rep - sum*sum)*n_rep/(n_rep-1.);
+		fprintf(fptr,"%8.2f\t%10.9f\t%10.9f\n",cap->e_start+i*cap->delta_e,sum,sum2 > 0. ? sqrt(sum2/n_rep) : 0.);
+		}
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the tiles of a spot map in use to a binary file
+void write_spot_tiles(FILE *fptr, struct spot_map *map)
+	{
+	int i;
+
+	fwrite(&map->n_tile,sizeof(int),1,fptr);
+	for(i=0; i<map->n_slot; i++){
+		if(map->tile[i].val == NULL) continue;
+		fwrite(&map->tile[i].tx,sizeof(int),1,fptr);
+		fwrite(&map->tile[i].ty,sizeof(int),1,fptr);
+		fwrite(map->tile[i].val,sizeof(double),SPOT_TILE*SPOT_TILE*map->nlayer,fptr);
+		}
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read spot map tiles written by write_spot_tiles and add them to map, returns 0 on a truncated file
+int add_spot_tiles(FILE *fptr, struct spot_map *map)
+	{
+	int i, j, n_tile, tx, ty;
+	double *val, *buf;
+
+	buf = malloc(sizeof(*buf)*SPOT_TILE*SPOT_TILE*map->nlayer);
+	if(buf == NULL){
+		printf("Could not allocate spot map tile memory.\n");
+		exit(0);
+		}
+	if(fread(&n_tile,sizeof(int),1,fptr) != 1){
+		free(buf);
+		return 0;
+		}
+	for(i=0; i<n_tile; i++){
+		if(fread(&tx,sizeof(int),1,fptr) != 1 || fread(&ty,sizeof(int),1,fptr) != 1 ||
+		   fread(buf,sizeof(double),SPOT_TILE*SPOT_TILE*map->nlayer,fptr) != SPOT_TILE*SPOT_TILE*map->nlayer){
+			free(buf);
+			return 0;
+			}
+		val = spot_tile(map, tx, ty, 1);
+		for(j=0; j<SPOT_TILE*SPOT_TILE*map->nlayer; j++) val[j] += buf[j];
+		}
+	free(buf);
+
+	return 1;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write the raw accumulators of one worker of a distributed run (binary), to be combined by -merge
+void write_partial(char *filename, struct inp_file *cap, struct mumc *absmu, struct cap_profile *profile, struct leakstruct *leaks, double *sum_cnt, double *absorb_sum, long sum_istart, long sum_ienter, long sum_refl)
+	{
+	FILE *fptr;
+	int i, header[4];
+
+	fptr = fopen(filename,"wb");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	header[0] = absmu->n_energy;
+	header[1] = profile->nmax;
+	header[2] = absmu->n_layer;
+	header[3] = cap->n_screen;
+	fwrite(PART_MAGIC,sizeof(char),sizeof(PART_MAGIC),fptr);
+	fwrite(header,sizeof(int),4,fptr);
+	fwrite(&profile->binsize,sizeof(double),1,fptr);
+	fwrite(&cap->ang_max,sizeof(double),1,fptr);
+	fwrite(&sum_istart,sizeof(long),1,fptr);
+	fwrite(&sum_ienter,sizeof(long),1,fptr);
+	fwrite(&sum_refl,sizeof(long),1,fptr);
+	fwrite(sum_cnt,sizeof(double),absmu->n_energy+1,fptr);
+	fwrite(leaks->leak,sizeof(double),absmu->n_energy+1,fptr);
+	fwrite(absorb_sum,sizeof(double),profile->nmax+1,fptr);
+	write_spot_tiles(fptr,leaks->spot);
+	write_spot_tiles(fptr,leaks->lspot);
+	for(i=0; i<cap->n_screen; i++){
+		write_spot_tiles(fptr,leaks->zspot[i]);
+		write_spot_tiles(fptr,leaks->zlspot[i]);
+		}
+	fwrite(leaks->mom,sizeof(double),NSTAT_MOM*(absmu->n_energy+1),fptr);
+	fwrite(leaks->posx,sizeof(double),NSPOT,fptr);
+	fwrite(leaks->posy,sizeof(double),NSPOT,fptr);
+	fwrite(leaks->ang,sizeof(double),NANG*NANG,fptr);
+	fclose(fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a partial result file and add it to the given accumulators
+void add_partial(char *filename, struct inp_file *cap, struct mumc *absmu, struct cap_profile *profile, struct leakstruct *leaks, double *sum_cnt, double *absorb_sum, long *sum_istart, long *sum_ienter, long *sum_refl)
+	{
+	FILE *fptr;
+	int i;
+	int header[4];
+	char magic[sizeof(PART_MAGIC)];
+	double binsize, ang_max;
+	long part_istart, part_ienter, part_refl;
+	double *ebuf, *dbuf;
+	struct leakstruct *part; //exit statistics of the partial result
+
+	fptr = fopen(filename,"rb");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	if(fread(magic,sizeof(char),sizeof(PART_MAGIC),fptr) != sizeof(PART_MAGIC) || strcmp(magic,PART_MAGIC) != 0 ||
+	   fread(header,sizeof(int),4,fptr) != 4 || fread(&binsize,sizeof(double),1,fptr) != 1 || fread(&ang_max,sizeof(double),1,fptr) != 1){
+		printf("%s is not a polycap partial result file.\n",filename);
+		exit(0);
+		}
+	if(header[0] != absmu->n_energy || header[1] != profile->nmax || header[2] != absmu->n_layer || header[3] != cap->n_screen ||
+	   binsize != profile->binsize || ang_max != cap->ang_max){
+		printf("Inconsistent partial result file %s: different energy, profile, spot or histogram settings.\n",filename);
+		exit(0);
+		}
+	ebuf = malloc(sizeof(*ebuf)*(absmu->n_energy+1));
+	dbuf = malloc(sizeof(*dbuf)*(profile->nmax+1));
+	if(ebuf == NULL || dbuf == NULL){
+		printf("Could not allocate partial read buffer memory.\n");
+		exit(0);
+		}
+	fread(&part_istart,sizeof(long),1,fptr);
+	fread(&part_ienter,sizeof(long),1,fptr);
+	fread(&part_refl,sizeof(long),1,fptr);
+	*sum_istart = *sum_istart + part_istart;
+	*sum_ienter = *sum_ienter + part_ienter;
+	*sum_refl = *sum_refl + part_refl;
+	fread(ebuf,sizeof(double),absmu->n_energy+1,fptr);
+	for(i=0; i<=absmu->n_energy; i++) sum_cnt[i] = sum_cnt[i] + ebuf[i];
+	fread(ebuf,sizeof(double),absmu->n_energy+1,fptr);
+	for(i=0; i<=absmu->n_energy; i++) leaks->leak[i] = leaks->leak[i] + ebuf[i];
+	fread(dbuf,sizeof(double),profile->nmax+1,fptr);
+	for(i=0; i<=profile->nmax; i++) absorb_sum[i] = absorb_sum[i] + dbuf[i];
+	if(add_spot_tiles(fptr,leaks->spot) == 0 || add_spot_tiles(fptr,leaks->lspot) == 0){
+		printf("Partial result file %s is truncated.\n",filename);
+		exit(0);
+		}
+	for(i=0; i<cap->n_screen; i++){
+		if(add_spot_tiles(fptr,leaks->zspot[i]) == 0 || add_spot_tiles(fptr,leaks->zlspot[i]) == 0){
+			printf("Partial result file %s is truncated.\n",filename);
+			exit(0);
+			}
+		}
+	part = reset_leak(cap,profile,absmu);
+	if(fread(part->mom,sizeof(double),NSTAT_MOM*(absmu->n_energy+1),fptr) != NSTAT_MOM*(absmu->n_energy+1) ||
+	   fread(part->posx,sizeof(double),NSPOT,fptr) != NSPOT || fread(part->posy,sizeof(double),NSPOT,fptr) != NSPOT ||
+	   fread(part->ang,sizeof(double),NANG*NANG,fptr) != NANG*NANG){
+		printf("Partial result file %s is truncated.\n",filename);
+		exit(0);
+		}
+	stats_merge(leaks,part);
+	free_leak(cap,part);
+	fclose(fptr);
+	free(ebuf);
+	free(dbuf);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Z-plane cache: the states of photons crossing the profile point at distance z from the entrance
+// (rounded up to a profile point), so runs with a profile that only differs downstream of it can
+// resume the photons there instead of tracing them from the source. Photons absorbed upstream are
+// restarted while recording, so the cache holds the photon totals and upstream accumulators
+// (absorption, leakage) of the recording run, which a resumed run adds to its own.
+// File layout: header (ZCACHE_MAGIC, n_energy, i_plane, n_layer, n_screen, e_start, delta_e, d_source,
+// cl, d_screen, z_screens, sig_rough, density, binsize, amu and scatf per energy, the source (see
+// zcache_write_source), zarr, profil and d_arr up to the plane, n_state, istart, ienter), the photon states, then the upstream accumulators (leak,
+// absorb up to the plane, leak spot map tiles).
+// The source the cached photons were drawn from: src_x, src_sigx/y, src_shiftx/y, n_sym and the source
+// model (type -1 without one), with its alias table and angular emission weights
+void zcache_write_source(FILE *fptr, struct inp_file *cap)
+	{
+	struct source_model *src = cap->source;
+	int type = (src != NULL) ? src->type : -1, n_pix;
+
+	fwrite(&cap->src_x,sizeof(double),1,fptr);
+	fwrite(&cap->src_sigx,sizeof(double),1,fptr);
+	fwrite(&cap->src_sigy,sizeof(double),1,fptr);
+	fwrite(&cap->src_shiftx,sizeof(double),1,fptr);
+	fwrite(&cap->src_shifty,sizeof(double),1,fptr);
+	fwrite(&cap->n_sym,sizeof(int),1,fptr);
+	fwrite(&type,sizeof(int),1,fptr);
+	if(src == NULL) return;
+	n_pix = src->nx*src->ny;
+	fwrite(&src->a,sizeof(double),1,fptr);
+	fwrite(&src->b,sizeof(double),1,fptr);
+	fwrite(&n_pix,sizeof(int),1,fptr);
+	fwrite(src->prob,sizeof(double),n_pix,fptr);
+	fwrite(src->alias,sizeof(int),n_pix,fptr);
+	fwrite(&src->n_ang,sizeof(int),1,fptr);
+	fwrite(&src->ang_max,sizeof(double),1,fptr);
+	if(src->n_ang > 0) fwrite(src->ang_w,sizeof(double),src->n_ang+1,fptr);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a source written by zcache_write_source, returns 0 when it differs from the source of cap
+int zcache_same_source(FILE *fptr, struct inp_file *cap)
+	{
+	struct source_model *src = cap->source;
+	int i, type, n_sym, n_pix, n_ang, same=1, ialias;
+	double d[5], val;
+
+	if(fread(d,sizeof(double),5,fptr) != 5 || fread(&n_sym,sizeof(int),1,fptr) != 1 || fread(&type,sizeof(int),1,fptr) != 1) return 0;
+	if(d[0] != cap->src_x || d[1] != cap->src_sigx || d[2] != cap->src_sigy || d[3] != cap->src_shiftx || d[4] != cap->src_shifty ||
+	   n_sym != cap->n_sym || type != ((src != NULL) ? src->type : -1)) return 0;
+	if(src == NULL) return 1;
+	if(fread(d,sizeof(double),2,fptr) != 2 || fread(&n_pix,sizeof(int),1,fptr) != 1) return 0;
+	if(d[0] != src->a || d[1] != src->b || n_pix != src->nx*src->ny) return 0;
+	for(i=0; i<n_pix; i++){
+		if(fread(&val,sizeof(double),1,fptr) != 1) return 0;
+		if(val != src->prob[i]) same = 0;
+		}
+	for(i=0; i<n_pix; i++){
+		if(fread(&ialias,sizeof(int),1,fptr) != 1) return 0;
+		if(ialias != src->alias[i]) same = 0;
+		}
+	if(fread(&n_ang,sizeof(int),1,fptr) != 1 || fread(d,sizeof(double),1,fptr) != 1) return 0;
+	if(n_ang != src->n_ang || d[0] != src->ang_max) return 0;
+	for(i=0; i<=n_ang && n_ang > 0; i++){
+		if(fread(&val,sizeof(double),1,fptr) != 1) return 0;
+		if(val != src->ang_w[i]) same = 0;
+		}
+
+	return same;
+	}
+// ---------------------------------------------------------------------------------------------------
+struct zcache *zcache_open(char *filename, double z, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu)
+	{
+	struct zcache *zc = malloc(sizeof(struct zcache));
+	int i, header[4];
+	long zero = 0;
+
+	if(zc == NULL){
+		printf("Could not allocate z-plane cache memory.\n");
+		exit(0);
+		}
+	if(z <= 0. || z > profile->cl){
+		printf("Cache plane %f cm is not inside the capillary (0 - %f cm).\n",z,profile->cl);
+		exit(0);
+		}
+	for(i=1; i<profile->nmax && profile->arr[i].zarr < z; i++);
+	zc->i_plane = i;
+	zc->z_plane = profile->arr[i].zarr;
+	zc->rec_size = 8*sizeof(double) + sizeof(long) + (absmu->n_energy+1)*sizeof(float);
+	zc->n_state = 0;
+	zc->states = NULL;
+	zc->absorb = NULL;
+	zc->fptr = fopen(filename,"wb");
+	if(zc->fptr == NULL){
+		printf("Could not open %s for writing.\n",filename);
+		exit(0);
+		}
+	header[0] = absmu->n_energy;
+	header[1] = zc->i_plane;
+	header[2] = absmu->n_layer;
+	header[3] = cap->n_screen;
+	fwrite(ZCACHE_MAGIC,sizeof(char),sizeof(ZCACHE_MAGIC),zc->fptr);
+	fwrite(header,sizeof(int),4,zc->fptr);
+	fwrite(&cap->e_start,sizeof(float),1,zc->fptr);
+	fwrite(&cap->delta_e,sizeof(float),1,zc->fptr);
+	fwrite(&cap->d_source,sizeof(double),1,zc->fptr);
+	fwrite(&profile->cl,sizeof(double),1,zc->fptr);
+	fwrite(&cap->d_screen,sizeof(double),1,zc->fptr);
+	fwrite(cap->z_screens,sizeof(double),cap->n_screen,zc->fptr);
+	fwrite(&cap->sig_rough,sizeof(double),1,zc->fptr);
+	fwrite(&cap->density,sizeof(float),1,zc->fptr);
+	fwrite(&profile->binsize,sizeof(double),1,zc->fptr);
+	for(i=0; i<=absmu->n_energy; i++){
+		fwrite(&absmu->arr[i].amu,sizeof(float),1,zc->fptr);
+		fwrite(&absmu->arr[i].scatf,sizeof(double),1,zc->fptr);
+		}
+	zcache_write_source(zc->fptr,cap);
+	for(i=0; i<=zc->i_plane; i++){
+		fwrite(&profile->arr[i].zarr,sizeof(double),1,zc->fptr);
+		fwrite(&profile->arr[i].profil,sizeof(double),1,zc->fptr);
+		fwrite(&profile->arr[i].d_arr,sizeof(double),1,zc->fptr);
+		}
+	//photon totals are filled in by zcache_close
+	zc->off_totals = ftell(zc->fptr);
+	fwrite(&zero,sizeof(long),1,zc->fptr);
+	fwrite(&zero,sizeof(long),1,zc->fptr);
+	fwrite(&zero,sizeof(long),1,zc->fptr);
+
+	return zc;
+	}
+// ---------------------------------------------------------------------------------------------------
+void zcache_flush(struct calcstruct *calc)
+	{
+	#pragma omp critical(zcache)
+		{
+		fwrite(calc->zbuf,sizeof(char),calc->n_zbuf,calc->zcache->fptr);
+		}
+	calc->n_zbuf = 0;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+void zcache_add_photon(struct calcstruct *calc, int n_energy)
+	{
+	char *rec;
+
+	if(calc->n_zbuf + calc->zcache->rec_size > HIST_BUF) zcache_flush(calc);
+	rec = calc->zbuf + calc->n_zbuf;
+	memcpy(rec,calc->rh,3*sizeof(double));
+	memcpy(rec+3*sizeof(double),calc->v,3*sizeof(double));
+	memcpy(rec+6*sizeof(double),&calc->chan_x,sizeof(double));
+	memcpy(rec+7*sizeof(double),&calc->chan_y,sizeof(double));
+	memcpy(rec+8*sizeof(double),&calc->i_refl,sizeof(long));
+	memcpy(rec+8*sizeof(double)+sizeof(long),calc->w,(n_energy+1)*sizeof(float));
+	calc->n_zbuf = calc->n_zbuf + calc->zcache->rec_size;
+	#pragma omp atomic
+	calc->zcache->n_state++;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Finish a recorded cache with the photon totals and the upstream accumulators of the run
+void zcache_close(struct zcache *zc, struct inp_file *cap, struct mumc *absmu, struct leakstruct *leaks, double *absorb_sum, long istart, long ienter)
+	{
+	int i;
+
+	fwrite(leaks->leak,sizeof(double),absmu->n_energy+1,zc->fptr);
+	fwrite(absorb_sum,sizeof(double),zc->i_plane,zc->fptr);
+	write_spot_tiles(zc->fptr,leaks->lspot);
+	for(i=0; i<cap->n_screen; i++) write_spot_tiles(zc->fptr,leaks->zlspot[i]);
+	fseek(zc->fptr,zc->off_totals,SEEK_SET);
+	fwrite(&zc->n_state,sizeof(long),1,zc->fptr);
+	fwrite(&istart,sizeof(long),1,zc->fptr);
+	fwrite(&ienter,sizeof(long),1,zc->fptr);
+	fclose(zc->fptr);
+	free(zc);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a z-plane cache to resume, after checking everything upstream of its plane is the same as in
+// this run. Its photon totals and leakage are added to the given accumulators, the upstream absorption
+// is kept in the returned cache.
+struct zcache *zcache_read(char *filename, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu, struct leakstruct *leaks, long *sum_istart, long *sum_ienter)
+	{
+	FILE *fptr;
+	struct zcache *zc;
+	char magic[sizeof(ZCACHE_MAGIC)];
+	int i, header[4], same;
+	float e_start, delta_e, density, amu;
+	double d_source, cl, d_screen, z_screen, sig_rough, binsize, scatf, zarr, profil, d_arr;
+	long istart, ienter;
+	double *ebuf;
+
+	fptr = fopen(filename,"rb");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	if(fread(magic,sizeof(char),sizeof(ZCACHE_MAGIC),fptr) != sizeof(ZCACHE_MAGIC) || strcmp(magic,ZCACHE_MAGIC) != 0 ||
+	   fread(header,sizeof(int),4,fptr) != 4){
+		printf("%s is not a polycap z-plane cache.\n",filename);
+		exit(0);
+		}
+	if(header[0] != absmu->n_energy || header[1] > profile->nmax || header[2] != absmu->n_layer || header[3] != cap->n_screen){
+		printf("Inconsistent z-plane cache %s: different energy, profile, spot or screen settings.\n",filename);
+		exit(0);
+		}
+	zc = malloc(sizeof(struct zcache));
+	if(zc == NULL){
+		printf("Could not allocate z-plane cache memory.\n");
+		exit(0);
+		}
+	zc->fptr = NULL;
+	zc->i_plane = header[1];
+	zc->rec_size = 8*sizeof(double) + sizeof(long) + (absmu->n_energy+1)*sizeof(float);
+
+	//the energies, materials, screens, source and the profile up to the plane should be unchanged
+	fread(&e_start,sizeof(float),1,fptr);
+	fread(&delta_e,sizeof(float),1,fptr);
+	fread(&d_source,sizeof(double),1,fptr);
+	fread(&cl,sizeof(double),1,fptr);
+	fread(&d_screen,sizeof(double),1,fptr);
+	same = e_start == cap->e_start && delta_e == cap->delta_e && d_source == cap->d_source && cl == profile->cl && d_screen == cap->d_screen;
+	for(i=0; i<cap->n_screen; i++){
+		fread(&z_screen,sizeof(double),1,fptr);
+		if(z_screen != cap->z_screens[i]) same = 0;
+		}
+	fread(&sig_rough,sizeof(double),1,fptr);
+	fread(&density,sizeof(float),1,fptr);
+	fread(&binsize,sizeof(double),1,fptr);
+	if(sig_rough != cap->sig_rough || density != cap->density || binsize != profile->binsize) same = 0;
+	for(i=0; i<=absmu->n_energy; i++){
+		fread(&amu,sizeof(float),1,fptr);
+		fread(&scatf,sizeof(double),1,fptr);
+		if(amu != absmu->arr[i].amu || scatf != absmu->arr[i].scatf) same = 0;
+		}
+	if(same == 0){
+		printf("Inconsistent z-plane cache %s: different energies, materials, roughness, length or screens.\n",filename);
+		exit(0);
+		}
+	if(zcache_same_source(fptr,cap) == 0){
+		printf("Inconsistent z-plane cache %s: recorded with a different source (size, divergence, shift, model or -hexsym).\n",filename);
+		exit(0);
+		}
+	for(i=0; i<=zc->i_plane; i++){
+		fread(&zarr,sizeof(double),1,fptr);
+		fread(&profil,sizeof(double),1,fptr);
+		if(fread(&d_arr,sizeof(double),1,fptr) != 1){
+			printf("Z-plane cache %s is truncated.\n",filename);
+			exit(0);
+			}
+		if(zarr != profile->arr[i].zarr || profil != profile->arr[i].profil || d_arr != profile->arr[i].d_arr){
+			printf("Capillary profile differs from z-plane cache %s at z = %f cm, upstream of its plane at %f cm.\n",
+				filename,profile->arr[i].zarr,profile->arr[zc->i_plane].zarr);
+			exit(0);
+			}
+		}
+	zc->z_plane = profile->arr[zc->i_plane].zarr;
+	fread(&zc->n_state,sizeof(long),1,fptr);
+	fread(&istart,sizeof(long),1,fptr);
+	fread(&ienter,sizeof(long),1,fptr);
+	*sum_istart = *sum_istart + istart;
+	*sum_ienter = *sum_ienter + ienter;
+
+	zc->states = malloc(zc->rec_size*zc->n_state);
+	zc->absorb = malloc(sizeof(*zc->absorb)*(zc->i_plane+1));
+	ebuf = malloc(sizeof(*ebuf)*(absmu->n_energy+1));
+	if(zc->states == NULL || zc->absorb == NULL || ebuf == NULL){
+		printf("Could not allocate z-plane cache memory.\n");
+		exit(0);
+		}
+	if(fread(zc->states,zc->rec_size,zc->n_state,fptr) != zc->n_state ||
+	   fread(ebuf,sizeof(double),absmu->n_energy+1,fptr) != absmu->n_energy+1 ||
+	   fread(zc->absorb,sizeof(double),zc->i_plane,fptr) != zc->i_plane ||
+	   add_spot_tiles(fptr,leaks->lspot) == 0){
+		printf("Z-plane cache %s is truncated.\n",filename);
+		exit(0);
+		}
+	for(i=0; i<cap->n_screen; i++){
+		if(add_spot_tiles(fptr,leaks->zlspot[i]) == 0){
+			printf("Z-plane cache %s is truncated.\n",filename);
+			exit(0);
+			}
+		}
+	for(i=0; i<=absmu->n_energy; i++) leaks->leak[i] = leaks->leak[i] + ebuf[i];
+	free(ebuf);
+	fclose(fptr);
+
+	return zc;
+	}
+// ---------------------------------------------------------------------------------------------------
+void zcache_free(struct zcache *zc)
+	{
+	free(zc->states);
+	free(zc->absorb);
+	free(zc);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Z-plane cache recording: trace a photon from the source until it crosses the cache plane, restarting
+// it when it does not enter a capillary or is absorbed before, and store its state at the plane.
+void trace_zrecord(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+	{
+	int i;
+	double c; //distance between last interaction and the plane, divided by propagation vector in z
+	struct calcstruct *cs = &calc[*thread_id];
+
+	do{
+		start(absmu, profile, pcap_ini, cap, icount, imstr, calc, thread_id, K_GENERIC);
+		do{
+			capil(absmu, profile, cap, cs->leaks, calc, thread_id, K_GENERIC);
+			} while(cs->iesc == 0);
+		} while(cs->iesc != 2);
+	c = (cap->d_source + cs->zcache->z_plane - cs->rh[2]) / cs->v[2];
+	for(i=0; i<3; i++) cs->rh[i] = cs->rh[i] + c*cs->v[i];
+	zcache_add_photon(cs, absmu->n_energy);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Z-plane cache resumption: trace cached photon icount from the plane to the screen. Photons absorbed
+// or leaving outside the exit area are not restarted, the cache already accounts for every photon that
+// entered a capillary.
+void trace_zresume(struct mumc *absmu, struct cap_profile *profile, struct ini_polycap *pcap_ini, struct inp_file *cap, int *icount, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+	{
+	int i;
+	struct calcstruct *cs = &calc[*thread_id];
+	struct zcache *zc = cs->zcache;
+	char *rec = zc->states + (long)*icount*zc->rec_size;
+
+	memcpy(cs->rh,rec,3*sizeof(double));
+	memcpy(cs->v,rec+3*sizeof(double),3*sizeof(double));
+	memcpy(&cs->chan_x,rec+6*sizeof(double),sizeof(double));
+	memcpy(&cs->chan_y,rec+7*sizeof(double),sizeof(double));
+	memcpy(&cs->i_refl,rec+8*sizeof(double),sizeof(long));
+	memcpy(cs->w,rec+8*sizeof(double)+sizeof(long),(absmu->n_energy+1)*sizeof(float));
+	for(i=zc->i_plane; i<=profile->nmax; i++){
+		cs->sx[i] = profile->arr[i].d_arr * cs->chan_x;
+		cs->sy[i] = profile->arr[i].d_arr * cs->chan_y;
+		}
+	cs->ix = zc->i_plane;
+	cs->phase = 0.;
+	cs->amplitude = 1.;
+	cs->traj_length = 0.;
+	cs->n_bounce = 0;
+
+	do{
+		capil(absmu, profile, cap, cs->leaks, calc, thread_id, K_GENERIC);
+		} while(cs->iesc == 0);
+	if(cs->iesc == -2) return;
+	count(absmu, cap, icount, profile, cs->leaks, imstr, calc, thread_id, K_GENERIC);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Tabulate the reflectivity for every energy at NREFL+1 grazing angles between 0 and REFL_MAX times
+// the critical angle (stored in crit), so re-weighting does not need the complex Fresnel expression
+// for every bounce. Scaling by the critical angle keeps the steep part of every curve equally well sampled.
+double *refl_table(struct inp_file *cap, struct mumc *absmu, double *crit)
+	{
+	int i, j;
+	float e;
+	double alf;
+	double *table = malloc(sizeof(*table)*(absmu->n_energy+1)*(NREFL+1));
+
+	if(table == NULL){
+		printf("Could not allocate reflectivity table memory.\n");
+		exit(0);
+		}
+	for(i=0; i<=absmu->n_energy; i++){
+		e = cap->e_start + i * cap->delta_e;
+		crit[i] = crit_angle(cap, absmu, i);
+		for(j=0; j<=NREFL; j++){
+			alf = REFL_MAX*crit[i]*j/NREFL;
+			table[i*(NREFL+1)+j] = reflectivity(alf, e, cap->density, absmu->arr[i].amu, absmu->arr[i].scatf);
+			}
+		}
+
+	return table;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Re-weight one recorded photon history (rec) with the material, roughness and energies of cap,
+// same weighting as start(), reflect() and count(). A photon that was dropped at the weight cutoff
+// while the new weights are still above it is counted in n_cut: its further path was not recorded.
+void reweight_photon(char *rec, struct inp_file *cap, struct mumc *absmu, double *table, double *crit, struct leakstruct *leaks, double *cnt, double *absorb, float *w, long *sum_refl, long *n_count, long *n_cut)
+	{
+	int i, j, k, n_bounce, status, ia;
+	double fa; //position of grazing angle in reflectivity table
+	float w_gamma, w0, e, wleak;
+	double rh[3], v[3];
+	double cons1, r_rough, rtot, c, xp, yp;
+	double *lbin, *sbin;
+	double *zlbin[NSCREEN]; //leak bins on the additional screens
+	struct hist_bounce bounce;
+
+	memcpy(&n_bounce,rec,sizeof(int));
+	memcpy(&status,rec+sizeof(int),sizeof(int));
+	memcpy(&w_gamma,rec+2*sizeof(int),sizeof(float));
+	memcpy(rh,rec+2*sizeof(int)+sizeof(float),3*sizeof(double));
+	memcpy(v,rec+2*sizeof(int)+sizeof(float)+3*sizeof(double),3*sizeof(double));
+	rec = rec+2*sizeof(int)+sizeof(float)+6*sizeof(double);
+
+	for(i=0; i<=absmu->n_energy; i++) w[i] = (float)1 * w_gamma;
+	for(j=0; j<n_bounce; j++){
+		memcpy(&bounce,rec+j*sizeof(struct hist_bounce),sizeof(struct hist_bounce));
+		w0 = w[0];
+		lbin = spot_bin(leaks->lspot, bounce.xp, bounce.yp);
+		for(k=0; k<cap->n_screen; k++){
+			zlbin[k] = spot_bin(leaks->zlspot[k], bounce.xp + (cap->z_screens[k]-cap->d_screen)*bounce.dxp,
+				bounce.yp + (cap->z_screens[k]-cap->d_screen)*bounce.dyp);
+			}
+		for(i=0; i<=absmu->n_energy; i++){
+			e = cap->e_start + i * cap->delta_e;
+			cons1 = (double)(1.01358e0*e)*bounce.alf*cap->sig_rough;
+			r_rough = exp(-1*cons1*cons1);
+			fa = bounce.alf/(REFL_MAX*crit[i])*NREFL;
+			ia = (int)floor(fa);
+			fa = fa - ia;
+			if(ia >= 0 && ia < NREFL) rtot = (1.-fa)*table[i*(NREFL+1)+ia] + fa*table[i*(NREFL+1)+ia+1];
+				else rtot = reflectivity(bounce.alf, e, cap->density, absmu->arr[i].amu, absmu->arr[i].scatf);
+			wleak = (1.-rtot) * w[i] * exp(-1.*bounce.desc * absmu->arr[i].amu);
+			leaks->leak[i] = leaks->leak[i] + wleak;
+			if(lbin != NULL && absmu->arr[i].layer >= 0) lbin[absmu->arr[i].layer] += wleak;
+			for(k=0; k<cap->n_screen; k++) if(zlbin[k] != NULL && absmu->arr[i].layer >= 0) zlbin[k][absmu->arr[i].layer] += wleak;
+			w[i] = w[i] * (float)(rtot * r_rough);
+			}
+		if(w[0] < 1.e-4) return; //photon dropped, as in reflect()
+		absorb[bounce.ix] = absorb[bounce.ix] + (double)(w0-w[0]);
+		}
+	if(status == 2) *n_cut = *n_cut + 1;
+	if(status != 1) return;
+
+	c = (cap->d_screen - rh[2]) / v[2];
+	xp = (float)(rh[0] + c*v[0]);
+	yp = (float)(rh[1] + c*v[1]);
+	sbin = spot_bin(leaks->spot, xp, yp);
+	for(i=0; i<=absmu->n_energy; i++){
+		cnt[i] = cnt[i] + w[i];
+		if(sbin != NULL && absmu->arr[i].layer >= 0) sbin[absmu->arr[i].layer] += w[i];
+		}
+	for(k=0; k<cap->n_screen; k++){
+		c = (cap->z_screens[k] - rh[2]) / v[2];
+		sbin = spot_bin(leaks->zspot[k], rh[0] + c*v[0], rh[1] + c*v[1]);
+		if(sbin == NULL) continue;
+		for(i=0; i<=absmu->n_energy; i++) if(absmu->arr[i].layer >= 0) sbin[absmu->arr[i].layer] += w[i];
+		}
+	stats_add(leaks, absmu->n_energy, xp, yp, v, w);
+	*sum_refl = *sum_refl + n_bounce;
+	*n_count = *n_count + 1;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Re-weighting engine: replay a bounce history file with the material, roughness and energies of cap
+// and add the resulting transmission, leaks, absorption and spot maps to the given accumulators.
+// The geometry (profile and screen distance) must be the one the history was recorded with.
+// The file is read in blocks of photons, which are re-weighted in parallel.
+void reweight(char *filename, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu, struct leakstruct *leaks, double *sum_cnt, double *absorb_sum, long *sum_istart, long *sum_ienter, long *sum_refl, long *n_count, int thread_cnt)
+	{
+	FILE *fptr;
+	char magic[sizeof(HIST_MAGIC)];
+	int nmax, n_bounce, i, j, t;
+	double d_source, cl, d_screen;
+	long n_photon, ip, n_block, size, max_block=1024, n_buf, max_buf=HIST_BUF, n_cut=0;
+	long *offset, *cut; //cut: dropped photons the new weights would have kept, per thread
+	char *buf;
+	double *table, *crit; //reflectivity per energy and grazing angle, critical angle per energy
+	struct calcstruct *calc; //per-thread accumulators
+
+	fptr = fopen(filename,"rb");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	if(fread(magic,sizeof(char),sizeof(HIST_MAGIC),fptr) != sizeof(HIST_MAGIC) || strcmp(magic,HIST_MAGIC) != 0 ||
+	   fread(&nmax,sizeof(int),1,fptr) != 1){
+		printf("%s is not a polycap bounce history file.\n",filename);
+		exit(0);
+		}
+	fread(&d_source,sizeof(double),1,fptr);
+	fread(&cl,sizeof(double),1,fptr);
+	fread(&d_screen,sizeof(double),1,fptr);
+	if(nmax != profile->nmax || fabs(d_source-cap->d_source) > DELTA || fabs(cl-profile->cl) > DELTA || fabs(d_screen-cap->d_screen) > DELTA){
+		printf("Bounce history %s was recorded with a different capillary geometry or screen distance.\n",filename);
+		exit(0);
+		}
+	fread(sum_istart,sizeof(long),1,fptr);
+	fread(sum_ienter,sizeof(long),1,fptr);
+	fread(&n_photon,sizeof(long),1,fptr);
+
+	crit = malloc(sizeof(*crit)*(absmu->n_energy+1));
+	if(crit == NULL){
+		printf("Could not allocate re-weighting memory.\n");
+		exit(0);
+		}
+	table = refl_table(cap, absmu, crit);
+	calc = alloc_calc(thread_cnt);
+	offset = malloc(sizeof(*offset)*max_block);
+	buf = malloc(max_buf);
+	cut = calloc(thread_cnt,sizeof(*cut));
+	if(calc == NULL || offset == NULL || buf == NULL || cut == NULL){
+		printf("Could not allocate re-weighting memory.\n");
+		exit(0);
+		}
+	for(t=0; t<thread_cnt; t++){
+		calc[t].w = malloc(sizeof(*calc[t].w)*(absmu->n_energy+1));
+		calc[t].cnt = malloc(sizeof(*calc[t].cnt)*(absmu->n_energy+1));
+		calc[t].absorb = malloc(sizeof(*calc[t].absorb)*(profile->nmax+1));
+		if(calc[t].w == NULL || calc[t].cnt == NULL || calc[t].absorb == NULL){
+			printf("Could not allocate re-weighting memory.\n");
+			exit(0);
+			}
+		for(i=0; i<=absmu->n_energy; i++) calc[t].cnt[i] = 0.;
+		for(i=0; i<=profile->nmax; i++) calc[t].absorb[i] = (double)0.;
+		calc[t].leaks = reset_leak(cap,profile,absmu);
+		calc[t].i_refl = 0;
+		calc[t].ienter = 0; //transmitted photons
+		}
+
+	ip = 0;
+	while(ip < n_photon){
+		//read a block of photon histories
+		n_block = 0;
+		n_buf = 0;
+		while(ip < n_photon && n_buf < HIST_BUF){
+			if(fread(&n_bounce,sizeof(int),1,fptr) != 1){
+				printf("Bounce history %s is truncated.\n",filename);
+				exit(0);
+				}
+			size = 2*sizeof(int) + sizeof(float) + 6*sizeof(double) + n_bounce*sizeof(struct hist_bounce);
+			if(n_buf+size > max_buf){
+				max_buf = 2*(n_buf+size);
+				buf = realloc(buf,max_buf);
+				}
+			if(n_block == max_block){
+				max_block = 2*max_block;
+				offset = realloc(offset,sizeof(*offset)*max_block);
+				}
+			if(buf == NULL || offset == NULL){
+				printf("Could not allocate re-weighting memory.\n");
+				exit(0);
+				}
+			memcpy(buf+n_buf,&n_bounce,sizeof(int));
+			if(fread(buf+n_buf+sizeof(int),1,size-sizeof(int),fptr) != (size_t)(size-sizeof(int))){
+				printf("Bounce history %s is truncated.\n",filename);
+				exit(0);
+				}
+			offset[n_block] = n_buf;
+			n_buf = n_buf + size;
+			n_block++;
+			ip++;
+			}
+		#pragma omp parallel for private(t) schedule(dynamic,64) num_threads(thread_cnt)
+		for(j=0; j<n_block; j++){
+			t = omp_get_thread_num();
+			reweight_photon(buf+offset[j], cap, absmu, table, crit, calc[t].leaks, calc[t].cnt, calc[t].absorb, calc[t].w, &calc[t].i_refl, &calc[t].ienter, &cut[t]);
+			}
+		}
+	fclose(fptr);
+
+	*sum_refl = 0;
+	*n_count = 0;
+	for(t=0; t<thread_cnt; t++){
+		for(i=0; i<=absmu->n_energy; i++){
+			sum_cnt[i] = sum_cnt[i] + calc[t].cnt[i];
+			leaks->leak[i] = leaks->leak[i] + calc[t].leaks->leak[i];
+			}
+		for(i=0; i<=profile->nmax; i++) absorb_sum[i] = absorb_sum[i] + calc[t].absorb[i];
+		spot_merge(leaks->spot,calc[t].leaks->spot);
+		spot_merge(leaks->lspot,calc[t].leaks->lspot);
+		for(i=0; i<cap->n_screen; i++){
+			spot_merge(leaks->zspot[i],calc[t].leaks->zspot[i]);
+			spot_merge(leaks->zlspot[i],calc[t].leaks->zlspot[i]);
+			}
+		stats_merge(leaks,calc[t].leaks);
+		*sum_refl = *sum_refl + calc[t].i_refl;
+		*n_count = *n_count + calc[t].ienter;
+		n_cut = n_cut + cut[t];
+		free(calc[t].w);
+		free(calc[t].cnt);
+		free(calc[t].absorb);
+		free_leak(cap,calc[t].leaks);
+		}
+	free(calc);
+	free(offset);
+	free(cut);
+	free(buf);
+	free(table);
+	free(crit);
+	if(n_cut > 0) printf("Warning: %ld of %ld recorded photons were dropped at the weight cutoff but stay above it when re-weighted, their further paths are missing from %s.\n",n_cut,n_photon,filename);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a source spectrum file: lines of energy [keV] and intensity [photons/keV], ascending in energy.
+// Returns the amount of spectrum points.
+int read_spectrum(char *filename, double **e_spec, double **i_spec)
+	{
+	FILE *fptr;
+	int n=0, max=256;
+	double e, inten;
+
+	fptr = fopen(filename,"r");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	*e_spec = malloc(sizeof(**e_spec)*max);
+	*i_spec = malloc(sizeof(**i_spec)*max);
+	if(*e_spec == NULL || *i_spec == NULL){
+		printf("Could not allocate spectrum memory.\n");
+		exit(0);
+		}
+	while(fscanf(fptr,"%lf %lf",&e,&inten) == 2){
+		if(n > 0 && e <= (*e_spec)[n-1]){
+			printf("Energies in spectrum file %s should be ascending.\n",filename);
+			exit(0);
+			}
+		if(n == max){
+			max = 2*max;
+			*e_spec = realloc(*e_spec,sizeof(**e_spec)*max);
+			*i_spec = realloc(*i_spec,sizeof(**i_spec)*max);
+			if(*e_spec == NULL || *i_spec == NULL){
+				printf("Could not allocate spectrum memory.\n");
+				exit(0);
+				}
+			}
+		(*e_spec)[n] = e;
+		(*i_spec)[n] = inten;
+		n++;
+		}
+	fclose(fptr);
+	if(n < 1){
+		printf("Spectrum file %s contains no data.\n",filename);
+		exit(0);
+		}
+
+	return n;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Intensity of the spectrum at energy e, linearly interpolated and zero outside the tabulated range
+double spectrum_at(double e, int n, double *e_spec, double *i_spec)
+	{
+	int lo=0, hi=n-1, mid;
+
+	if(n == 1) return fabs(e-e_spec[0]) < 1.e-6 ? i_spec[0] : 0.;
+	if(e < e_spec[0] || e > e_spec[n-1]) return 0.;
+	while(hi - lo > 1){
+		mid = (lo+hi)/2;
+		if(e_spec[mid] > e) hi = mid;
+			else lo = mid;
+		}
+
+	return i_spec[lo] + (i_spec[hi]-i_spec[lo])*(e-e_spec[lo])/(e_spec[hi]-e_spec[lo]);
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a measured source intensity image: one row of pixels per line, from +y (top) to -y, each row
+// from -x to +x. Returns the pixel values, row by row, and their amount along x (nx) and y (ny).
+double *read_source_image(char *filename, int *nx, int *ny)
+	{
+	FILE *fptr;
+	char *line = NULL, *str, *end;
+	size_t len = 0;
+	int n=0, max=4096, n_row;
+	double val, *img;
+
+	fptr = fopen(filename,"r");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	img = malloc(sizeof(*img)*max);
+	if(img == NULL){
+		printf("Could not allocate source image memory.\n");
+		exit(0);
+		}
+	*nx = 0;
+	*ny = 0;
+	while(getline(&line,&len,fptr) != -1){
+		n_row = 0;
+		for(str=line; ; str=end){
+			val = strtod(str,&end);
+			if(end == str) break;
+			if(val < 0.){
+				printf("Source image %s has a negative pixel in row %d.\n",filename,*ny+1);
+				exit(0);
+				}
+			if(n == max){
+				max = 2*max;
+				img = realloc(img,sizeof(*img)*max);
+				if(img == NULL){
+					printf("Could not allocate source image memory.\n");
+					exit(0);
+					}
+				}
+			img[n++] = val;
+			n_row++;
+			}
+		if(n_row == 0) continue; //empty line
+		if(*ny > 0 && n_row != *nx){
+			printf("Row %d of source image %s has %d pixels instead of %d.\n",*ny+1,filename,n_row,*nx);
+			exit(0);
+			}
+		*nx = n_row;
+		(*ny)++;
+		}
+	free(line);
+	fclose(fptr);
+	if(n < 1){
+		printf("Source image %s contains no data.\n",filename);
+		exit(0);
+		}
+
+	return img;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Build the alias table (Vose) of the n probabilities p, so a pixel is drawn with a single uniform
+// number: bin k = floor(u*n) is kept with probability prob[k], else alias[k] is taken
+void alias_table(int n, double *p, double *prob, int *alias)
+	{
+	int i, n_small=0, n_large=0, s, l;
+	int *small, *large; //work lists of bins below and above the average
+	double sum=0.;
+
+	small = malloc(sizeof(*small)*n);
+	large = malloc(sizeof(*large)*n);
+	if(small == NULL || large == NULL){
+		printf("Could not allocate alias table memory.\n");
+		exit(0);
+		}
+	for(i=0; i<n; i++) sum = sum + p[i];
+	for(i=0; i<n; i++){
+		prob[i] = p[i]*n/sum;
+		alias[i] = i;
+		if(prob[i] < 1.) small[n_small++] = i;
+			else large[n_large++] = i;
+		}
+	while(n_small > 0 && n_large > 0){
+		s = small[--n_small];
+		l = large[--n_large];
+		alias[s] = l;
+		prob[l] = prob[l] - (1.-prob[s]);
+		if(prob[l] < 1.) small[n_small++] = l;
+			else large[n_large++] = l;
+		}
+	//what is left is 1 up to rounding
+	while(n_large > 0) prob[large[--n_large]] = 1.;
+	while(n_small > 0) prob[small[--n_small]] = 1.;
+	free(small);
+	free(large);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Set up the source model of -source and -source_ang, NULL when neither is given (uniform disk of
+// radius src_x emitting isotropically). Everything start() needs is tabulated here, so drawing a
+// source point or looking up the emission weight takes constant time.
+struct source_model *source_alloc(struct run_opts *opts)
+	{
+	struct source_model *src;
+	int i, k, n;
+	double *img, *e_ang, *i_ang, t, i0;
+
+	if(opts->source == NULL && opts->source_ang == NULL) return NULL;
+	src = malloc(sizeof(struct source_model));
+	if(src == NULL){
+		printf("Could not allocate source model memory.\n");
+		exit(0);
+		}
+	src->type = SRC_DISK;
+	src->nx = 0;
+	src->ny = 0;
+	src->prob = NULL;
+	src->alias = NULL;
+	src->n_ang = 0;
+	src->ang_max = 0.;
+	src->ang_w = NULL;
+	if(opts->source != NULL){
+		if(strcmp(opts->source,"gauss") == 0) src->type = SRC_GAUSS;
+			else if(strcmp(opts->source,"ellipse") == 0) src->type = SRC_ELLIPSE;
+			else if(strcmp(opts->source,"image") == 0) src->type = SRC_IMAGE;
+			else {
+			printf("Unknown source model %s, should be gauss, ellipse or image.\n",opts->source);
+			exit(0);
+			}
+		if(src->type == SRC_IMAGE){
+			src->a = atof(opts->source_p2);
+			src->b = src->a;
+			} else {
+			src->a = atof(opts->source_p1);
+			src->b = atof(opts->source_p2);
+			}
+		if(src->a <= 0. || src->b <= 0.){
+			printf("Source widths and pixel size should be positive.\n");
+			exit(0);
+			}
+		}
+	if(src->type == SRC_IMAGE){
+		img = read_source_image(opts->source_p1, &src->nx, &src->ny);
+		n = src->nx*src->ny;
+		t = 0.;
+		for(i=0; i<n; i++) t = t + img[i];
+		if(t <= 0.){
+			printf("Source image %s is empty.\n",opts->source_p1);
+			exit(0);
+			}
+		src->prob = malloc(sizeof(*src->prob)*n);
+		src->alias = malloc(sizeof(*src->alias)*n);
+		if(src->prob == NULL || src->alias == NULL){
+			printf("Could not allocate source model memory.\n");
+			exit(0);
+			}
+		alias_table(n, img, src->prob, src->alias);
+		free(img);
+		}
+
+	//angular emission profile, resampled on NSRC_ANG equal intervals and relative to its first angle
+	if(opts->source_ang != NULL){
+		n = read_spectrum(opts->source_ang, &e_ang, &i_ang);
+		if(n < 2 || e_ang[0] < 0. || i_ang[0] <= 0.){
+			printf("Angular emission profile %s needs at least 2 angles from 0 rad on and a positive first intensity.\n",opts->source_ang);
+			exit(0);
+			}
+		src->n_ang = NSRC_ANG;
+		src->ang_max = e_ang[n-1];
+		src->ang_w = malloc(sizeof(*src->ang_w)*(NSRC_ANG+1));
+		if(src->ang_w == NULL){
+			printf("Could not allocate source model memory.\n");
+			exit(0);
+			}
+		i0 = i_ang[0];
+		for(i=0, k=0; i<=NSRC_ANG; i++){
+			t = src->ang_max*i/NSRC_ANG;
+			while(k < n-2 && e_ang[k+1] < t) k++;
+			if(t <= e_ang[0]) src->ang_w[i] = i_ang[0]/i0;
+				else src->ang_w[i] = (i_ang[k] + (i_ang[k+1]-i_ang[k])*(t-e_ang[k])/(e_ang[k+1]-e_ang[k]))/i0;
+			if(src->ang_w[i] < 0.){
+				printf("Angular emission profile %s has a negative intensity.\n",opts->source_ang);
+				exit(0);
+				}
+			}
+		free(e_ang);
+		free(i_ang);
+		}
+
+	return src;
+	}
+// ---------------------------------------------------------------------------------------------------
+void source_free(struct source_model *src)
+	{
+	free(src->prob);
+	free(src->alias);
+	free(src->ang_w);
+	free(src);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Store the filter layers given as comma separated list of Z:thickness[cm] in iz and thick.
+// Returns the amount of filter layers.
+int read_filters(char *filters, int *iz, double *thick)
+	{
+	int n=0;
+	char *str, *end;
+
+	if(filters == NULL) return 0;
+	str = filters;
+	while(*str != '\0'){
+		if(n >= NFILTER){
+			printf("At most %d filter layers can be used.\n",NFILTER);
+			exit(0);
+			}
+		iz[n] = (int)strtol(str,&end,10);
+		if(end == str || *end != ':' || iz[n] < 1 || iz[n] > NELEM){
+			printf("Invalid filter list: %s\n",filters);
+			exit(0);
+			}
+		str = end+1;
+		thick[n] = strtod(str,&end);
+		if(end == str || thick[n] < 0. || (*end != ',' && *end != '\0')){
+			printf("Invalid filter list: %s\n",filters);
+			exit(0);
+			}
+		n++;
+		str = (*end == ',') ? end+1 : end;
+		}
+
+	return n;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Fold the exit weights recorded with -exitw with a source spectrum and a stack of elemental filters:
+// writes the source, filtered and transmitted flux per energy (*.out.fold file) and the transmitted
+// flux spot map (spot_fold.dat). The flux is normalized to the spectrum emitted in the simulated
+// source cone, i.e. the transmitted flux at energy i is S(E_i)*T(E_i)*delta_e*I/I0(E_i).
+void fold(char *filename, char *spectrum, char *filters, struct inp_file *cap, int nspot)
+	{
+	FILE *fptr;
+	char magic[sizeof(EXITW_MAGIC)], f_fold[100];
+	int n_energy, n_spec, n_filter, i;
+	int iz[NFILTER];
+	double thick[NFILTER];
+	float e_start, delta_e, e;
+	double d_screen, binsize;
+	long istart, ienter, n_photon, ip, n_block, k;
+	double *e_spec, *i_spec; //source spectrum
+	double *src, *trans, *coef, *flux; //per energy source flux, filter transmission, spot weight, transmitted flux
+	double sum_src=0., sum_filt=0., sum_flux=0., w_spot;
+	float *buf;
+	struct spot_map *spot;
+
+	fptr = fopen(filename,"rb");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(0);
+		}
+	if(fread(magic,sizeof(char),sizeof(EXITW_MAGIC),fptr) != sizeof(EXITW_MAGIC) || strcmp(magic,EXITW_MAGIC) != 0 ||
+	   fread(&n_energy,sizeof(int),1,fptr) != 1){
+		printf("%s is not a polycap exit weight file.\n",filename);
+		exit(0);
+		}
+	fread(&e_start,sizeof(float),1,fptr);
+	fread(&delta_e,sizeof(float),1,fptr);
+	fread(&d_screen,sizeof(double),1,fptr);
+	fread(&binsize,sizeof(double),1,fptr);
+	fread(&istart,sizeof(long),1,fptr);
+	fread(&ienter,sizeof(long),1,fptr);
+	fread(&n_photon,sizeof(long),1,fptr);
+	if(istart < 1){
+		printf("Exit weight file %s contains no started photons.\n",filename);
+		exit(0);
+		}
+
+	n_spec = read_spectrum(spectrum, &e_spec, &i_spec);
+	n_filter = read_filters(filters, iz, thick);
+	src = malloc(sizeof(*src)*(n_energy+1));
+	trans = malloc(sizeof(*trans)*(n_energy+1));
+	coef = malloc(sizeof(*coef)*(n_energy+1));
+	flux = malloc(sizeof(*flux)*(n_energy+1));
+	n_block = HIST_BUF/((n_energy+3)*sizeof(float)) + 1;
+	buf = malloc(sizeof(*buf)*(n_energy+3)*n_block);
+	if(src == NULL || trans == NULL || coef == NULL || flux == NULL || buf == NULL){
+		printf("Could not allocate folding memory.\n");
+		exit(0);
+		}
+	for(i=0; i<=n_energy; i++){
+		e = e_start + i*delta_e;
+		src[i] = spectrum_at(e, n_spec, e_spec, i_spec) * delta_e;
+		trans[i] = 1.;
+		for(k=0; k<n_filter; k++) trans[i] = trans[i] * exp(-1.*CS_Total(iz[k],e)*ElementDensity(iz[k])*thick[k]);
+		coef[i] = src[i]*trans[i]/(double)istart;
+		flux[i] = 0.;
+		}
+	spot = spot_alloc(binsize,1);
+
+	//read the transmitted photons in blocks and accumulate the folded flux
+	for(ip=0; ip<n_photon; ip+=n_block){
+		if(n_photon-ip < n_block) n_block = n_photon-ip;
+		if(fread(buf,sizeof(*buf)*(n_energy+3),n_block,fptr) != (size_t)n_block){
+			printf("Exit weight file %s is truncated.\n",filename);
+			exit(0);
+			}
+		for(k=0; k<n_block; k++){
+			w_spot = 0.;
+			for(i=0; i<=n_energy; i++){
+				flux[i] = flux[i] + coef[i]*buf[k*(n_energy+3)+2+i];
+				w_spot = w_spot + coef[i]*buf[k*(n_energy+3)+2+i];
+				}
+			spot_add(spot, buf[k*(n_energy+3)], buf[k*(n_energy+3)+1], 0, w_spot);
+			}
+		}
+	fclose(fptr);
+
+	sprintf(f_fold,"%.90s.fold",cap->out);
+	fptr = fopen(f_fold,"w");
+	if(fptr == NULL){
+		printf("Trouble with output...\n");
+		exit(0);
+		}
+	fprintf(fptr,"Exit weights     : %s\n",filename);
+	fprintf(fptr,"Source spectrum  : %s\n",spectrum);
+	fprintf(fptr,"Filters          : %s\n",filters != NULL ? filters : "none");
+	fprintf(fptr,"Screen distance [cm]:\t\t %f\n",d_screen);
+	fprintf(fptr,"  E [keV]      source\tfiltered\ttransmitted\n");
+	fprintf(fptr,"$DATA:\n");
+	fprintf(fptr,"%d\t%d\n",n_energy+1,4);
+	for(i=0; i<=n_energy; i++){
+		fprintf(fptr,"%8.2f\t%e\t%e\t%e\n",e_start+i*delta_e,src[i],src[i]*trans[i],flux[i]);
+		sum_src = sum_src + src[i];
+		sum_filt = sum_filt + src[i]*trans[i];
+		sum_flux = sum_flux + flux[i];
+		}
+	fprintf(fptr,"\nSource flux: %e\n",sum_src);
+	fprintf(fptr,"Filtered flux: %e\n",sum_filt);
+	fprintf(fptr,"Transmitted flux: %e\n",sum_flux);
+	fclose(fptr);
+	printf("Folded %ld transmitted photons, transmitted flux %e of %e\n",n_photon,sum_flux,sum_filt);
+	write_spot("spot_fold.dat",spot,nspot,0);
+
+	spot_free(spot);
+	free(e_spec);
+	free(i_spec);
+	free(src);
+	free(trans);
+	free(coef);
+	free(flux);
+	free(buf);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read the energies and transmitted fraction of the started photons (third column) from a *.out
+// file, plus the amount of started photons; returns the amount of energies
+int read_out_file(char *filename, double **e, double **trans, long *istart)
+	{
+	FILE *fptr;
+	char line[1000];
+	int i, n, ncol;
+	double col[5];
+
+	fptr = fopen(filename,"r");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(1);
+		}
+	do{
+		if(fgets(line,sizeof(line),fptr) == NULL){
+			printf("%s is not a polycap output file.\n",filename);
+			exit(1);
+			}
+		} while(strncmp(line,"$DATA:",6) != 0);
+	if(fscanf(fptr,"%d %d",&n,&ncol) != 2 || n < 1 || ncol != 5){
+		printf("%s is not a polycap output file.\n",filename);
+		exit(1);
+		}
+	*e = malloc(sizeof(**e)*n);
+	*trans = malloc(sizeof(**trans)*n);
+	if(*e == NULL || *trans == NULL){
+		printf("Could not allocate comparison memory.\n");
+		exit(1);
+		}
+	for(i=0; i<n; i++){
+		if(fscanf(fptr,"%lf %lf %lf %lf %lf",&col[0],&col[1],&col[2],&col[3],&col[4]) != 5){
+			printf("%s is truncated.\n",filename);
+			exit(1);
+			}
+		(*e)[i] = col[0];
+		(*trans)[i] = col[2];
+		}
+	*istart = 0;
+	while(fgets(line,sizeof(line),fptr) != NULL) if(sscanf(line,"The started photons: %ld",istart) == 1) break;
+	fclose(fptr);
+	if(*istart < 1){
+		printf("%s contains no started photons.\n",filename);
+		exit(1);
+		}
+
+	return n;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read the absorbed weight per capillary segment from a *.out.abs file; returns the amount of segments
+int read_abs_file(char *filename, double **absorb)
+	{
+	FILE *fptr;
+	char line[1000];
+	int i, n, ncol;
+	double z;
+
+	fptr = fopen(filename,"r");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(1);
+		}
+	if(fgets(line,sizeof(line),fptr) == NULL || strncmp(line,"$DATA:",6) != 0 ||
+	   fscanf(fptr,"%d %d",&n,&ncol) != 2 || n < 0 || ncol != 2){
+		printf("%s is not a polycap absorption profile.\n",filename);
+		exit(1);
+		}
+	n = n+1; //the header holds the last segment index
+	*absorb = malloc(sizeof(**absorb)*n);
+	if(*absorb == NULL){
+		printf("Could not allocate comparison memory.\n");
+		exit(1);
+		}
+	for(i=0; i<n; i++){
+		if(fscanf(fptr,"%lf %lf",&z,&(*absorb)[i]) != 2){
+			printf("%s is truncated.\n",filename);
+			exit(1);
+			}
+		}
+	fclose(fptr);
+
+	return n;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Read a spot map written by write_spot(); returns the amount of bins along x and y
+int read_spot_file(char *filename, double **bins)
+	{
+	FILE *fptr;
+	int i, nx, ny;
+
+	fptr = fopen(filename,"r");
+	if(fptr == NULL){
+		printf("%s file does not exist.\n",filename);
+		exit(1);
+		}
+	if(fscanf(fptr,"%d %d",&nx,&ny) != 2 || nx < 1 || ny != nx){
+		printf("%s is not a polycap spot map.\n",filename);
+		exit(1);
+		}
+	*bins = malloc(sizeof(**bins)*nx*nx);
+	if(*bins == NULL){
+		printf("Could not allocate comparison memory.\n");
+		exit(1);
+		}
+	for(i=0; i<nx*nx; i++){
+		if(fscanf(fptr,"%lf",&(*bins)[i]) != 1){
+			printf("%s is truncated.\n",filename);
+			exit(1);
+			}
+		}
+	fclose(fptr);
+
+	return nx;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Chi-square of the difference between the histograms a and b of n bins, normalised to na and nb
+// started photons. A photon adds a weight of at most 1 to a bin, so the summed weight of a bin bounds
+// its variance. Consecutive bins are merged until their combined weight reaches min_w, dof returns
+// the amount of merged bins.
+double chi2_weighted(int n, double *a, double na, double *b, double nb, double min_w, int *dof)
+	{
+	int i;
+	double chi2=0., d, var, sum_a=0., sum_b=0.;
+
+	*dof = 0;
+	for(i=0; i<n; i++){
+		sum_a = sum_a + a[i];
+		sum_b = sum_b + b[i];
+		if((sum_a+sum_b < min_w && i < n-1) || sum_a+sum_b <= 0.) continue;
+		d = sum_a/na - sum_b/nb;
+		var = sum_a/(na*na) + sum_b/(nb*nb);
+		chi2 = chi2 + d*d/var;
+		*dof = *dof + 1;
+		sum_a = 0.;
+		sum_b = 0.;
+		}
+
+	return chi2;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Kolmogorov-Smirnov significance of the largest distance between the cumulative distributions of
+// the histograms a and b of n bins. Their summed weights act as sample sizes, which underestimates
+// the amount of photons behind them and keeps the test conservative (Numerical Recipes, probks).
+double ks_weighted(int n, double *a, double *b, double *dist)
+	{
+	int i, k;
+	double sum_a=0., sum_b=0., fa=0., fb=0., ne, lambda, term, prev=0., fac=2., prob=0.;
+
+	for(i=0; i<n; i++){
+		sum_a = sum_a + a[i];
+		sum_b = sum_b + b[i];
+		}
+	*dist = 0.;
+	if(sum_a <= 0. || sum_b <= 0.) return 1.;
+	for(i=0; i<n; i++){
+		fa = fa + a[i]/sum_a;
+		fb = fb + b[i]/sum_b;
+		if(fabs(fa-fb) > *dist) *dist = fabs(fa-fb);
+		}
+	ne = sqrt(sum_a*sum_b/(sum_a+sum_b));
+	lambda = (ne+0.12+0.11/ne) * *dist;
+	for(k=1; k<=100; k++){
+		term = fac*exp(-2.*k*k*lambda*lambda);
+		prob = prob + term;
+		if(fabs(term) <= 0.001*prev || fabs(term) <= 1e-8*prob) return (prob > 1.) ? 1. : prob;
+		fac = -fac;
+		prev = fabs(term);
+		}
+
+	return 1.; //no convergence for very small distances
+	}
+// ---------------------------------------------------------------------------------------------------
+// Print the outcome of one comparison test and count it if significant
+void compare_report(char *test, double prob, int *n_fail)
+	{
+	printf("%-28s p = %-10.3g %s\n",test,prob,(prob < COMPARE_ALPHA) ? "DEVIATES" : "OK");
+	if(prob < COMPARE_ALPHA) *n_fail = *n_fail + 1;
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Compare the outputs of a reference and a test run of the same input file, written in the directories
+// ref and test: transmission spectra (*.out), absorption profiles (*.out.abs) and spot maps (spot.dat).
+// Returns the amount of tests with a significant deviation. The energies share the photon paths and are
+// strongly correlated, so the spectrum is judged by its largest deviation with a Bonferroni correction
+// instead of by its chi-square, which is only printed. Missing or unreadable outputs exit with status 1
+// instead of 0 as elsewhere, so a validation run can not pass without comparing anything.
+int compare(char *ref, char *test, struct inp_file *cap)
+	{
+	char f_name[300];
+	int i, j, k, n, n_fail=0, dof, nbin, nc, f, i_max=0;
+	int i_lo, i_hi, j_lo, j_hi; //illuminated part of the spot maps
+	long n_ref, n_test;
+	double *e, *e_test, *t_ref, *t_test; //transmission spectra
+	double *a_ref, *a_test; //absorption profiles
+	double *s_ref, *s_test, *c_ref, *c_test, *r_ref, *r_test; //spot maps, coarse spot maps, radial profiles
+	double chi2, z, z_max=0., var, dist;
+
+	sprintf(f_name,"%.140s/%.140s",ref,cap->out);
+	n = read_out_file(f_name, &e, &t_ref, &n_ref);
+	sprintf(f_name,"%.140s/%.140s",test,cap->out);
+	if(read_out_file(f_name, &e_test, &t_test, &n_test) != n){
+		printf("%s has a different energy range than the reference.\n",f_name);
+		exit(1);
+		}
+	printf("Comparing %s (%ld photons) with reference %s (%ld photons)\n",test,n_test,ref,n_ref);
+	for(i=0, chi2=0., dof=0; i<n; i++){
+		var = t_ref[i]/n_ref + t_test[i]/n_test;
+		if(var <= 0.) continue;
+		z = (t_test[i]-t_ref[i])/sqrt(var);
+		chi2 = chi2 + z*z;
+		dof++;
+		if(fabs(z) > z_max){
+			z_max = fabs(z);
+			i_max = i;
+			}
+		}
+	printf("Transmission spectrum: chi2/dof %.3f, largest deviation %.2f sigma at %.2f keV\n",(dof > 0) ? chi2/dof : 0.,z_max,e[i_max]);
+	compare_report("Transmission spectrum",fmin(1.,2.*dof*gsl_cdf_ugaussian_Q(z_max)),&n_fail);
+
+	sprintf(f_name,"%.140s/%.140s.abs",ref,cap->out);
+	n = read_abs_file(f_name, &a_ref);
+	sprintf(f_name,"%.140s/%.140s.abs",test,cap->out);
+	if(read_abs_file(f_name, &a_test) != n){
+		printf("%s has a different amount of segments than the reference.\n",f_name);
+		exit(1);
+		}
+	chi2 = chi2_weighted(n, a_ref, n_ref, a_test, n_test, COMPARE_MINW, &dof);
+	printf("Absorption profile: chi2 %.1f for %d merged segments\n",chi2,dof);
+	compare_report("Absorption profile",(dof > 0) ? gsl_cdf_chisq_Q(chi2,dof) : 1.,&n_fail);
+	compare_report("Absorption profile shape",ks_weighted(n, a_ref, a_test, &dist),&n_fail);
+
+	sprintf(f_name,"%.140s/spot.dat",ref);
+	nbin = read_spot_file(f_name, &s_ref);
+	sprintf(f_name,"%.140s/spot.dat",test);
+	if(read_spot_file(f_name, &s_test) != nbin){
+		printf("%s has a different size than the reference.\n",f_name);
+		exit(1);
+		}
+	//rebin the illuminated part to at most COMPARE_NBIN bins along x and y for the chi-square, and
+	//the whole map to rings around the optical axis for the radial profile
+	i_lo = nbin;
+	j_lo = nbin;
+	i_hi = 0;
+	j_hi = 0;
+	for(j=0; j<nbin; j++){
+		for(i=0; i<nbin; i++){
+			if(s_ref[j*nbin+i]+s_test[j*nbin+i] <= 0.) continue;
+			if(i < i_lo) i_lo = i;
+			if(i > i_hi) i_hi = i;
+			if(j < j_lo) j_lo = j;
+			if(j > j_hi) j_hi = j;
+			}
+		}
+	if(i_lo > i_hi){
+		i_lo = 0;
+		j_lo = 0;
+		}
+	n = (i_hi-i_lo > j_hi-j_lo) ? i_hi-i_lo+1 : j_hi-j_lo+1;
+	f = (n+COMPARE_NBIN-1)/COMPARE_NBIN;
+	nc = (n+f-1)/f;
+	c_ref = calloc(nc*nc,sizeof(*c_ref));
+	c_test = calloc(nc*nc,sizeof(*c_test));
+	r_ref = calloc(nbin,sizeof(*r_ref));
+	r_test = calloc(nbin,sizeof(*r_test));
+	if(c_ref == NULL || c_test == NULL || r_ref == NULL || r_test == NULL){
+		printf("Could not allocate comparison memory.\n");
+		exit(1);
+		}
+	for(j=0; j<nbin; j++){
+		for(i=0; i<nbin; i++){
+			if(i >= i_lo && i < i_lo+nc*f && j >= j_lo && j < j_lo+nc*f){
+				c_ref[((j-j_lo)/f)*nc+(i-i_lo)/f] = c_ref[((j-j_lo)/f)*nc+(i-i_lo)/f] + s_ref[j*nbin+i];
+				c_test[((j-j_lo)/f)*nc+(i-i_lo)/f] = c_test[((j-j_lo)/f)*nc+(i-i_lo)/f] + s_test[j*nbin+i];
+				}
+			k = (int)sqrt((double)(i-nbin/2)*(i-nbin/2)+(double)(j-nbin/2)*(j-nbin/2));
+			r_ref[k] = r_ref[k] + s_ref[j*nbin+i];
+			r_test[k] = r_test[k] + s_test[j*nbin+i];
+			}
+		}
+	chi2 = chi2_weighted(nc*nc, c_ref, n_ref, c_test, n_test, COMPARE_MINW, &dof);
+	printf("Spot map: chi2 %.1f for %d merged bins of %dx%d\n",chi2,dof,f,f);
+	compare_report("Spot map",(dof > 0) ? gsl_cdf_chisq_Q(chi2,dof) : 1.,&n_fail);
+	compare_report("Spot radial profile",ks_weighted(nbin, r_ref, r_test, &dist),&n_fail);
+
+	if(n_fail > 0) printf("%d significant deviations from the reference at the %g level.\n",n_fail,COMPARE_ALPHA);
+		else printf("No significant deviations from the reference.\n");
+
+	free(e);
+	free(e_test);
+	free(t_ref);
+	free(t_test);
+	free(a_ref);
+	free(a_test);
+	free(s_ref);
+	free(s_test);
+	free(c_ref);
+	free(c_test);
+	free(r_ref);
+	free(r_test);
+
+	return n_fail;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Start writing run snapshots to filename every interval seconds
+struct telemetry *telemetry_open(char *filename, double interval, int thread_cnt)
+	{
+	struct telemetry *telem;
+
+	telem = malloc(sizeof(struct telemetry));
+	if(telem == NULL){
+		printf("Could not allocate telemetry memory.\n");
+		exit(0);
+		}
+	telem->prev = calloc(3*thread_cnt,sizeof(long));
+	if(telem->prev == NULL){
+		printf("Could not allocate telemetry memory.\n");
+		exit(0);
+		}
+	sprintf(telem->filename,"%.99s",filename);
+	telem->interval = interval;
+	telem->t_prev = 0.;
+	telem->t_next = interval;
+
+	return telem;
+	}
+// ---------------------------------------------------------------------------------------------------
+void telemetry_close(struct telemetry *telem)
+	{
+	free(telem->prev);
+	free(telem);
+
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Write a JSON snapshot of a running trace at wall clock time t_now [s] since its start: the overall
+// progress, throughput, ETA, transmission estimate and peak memory use, and the started, entered and
+// transmitted photons per second of each thread since the previous snapshot. The transmission is the
+// transmitted fraction averaged over the energies, with the error bound of a weight of at most 1 per
+// photon. The snapshot is written to a temporary file and renamed over the previous one, so readers
+// never see a partial file. The counters of the other threads are read while they are running and may
+// lag by a photon.
+void telemetry_write(struct telemetry *telem, struct calcstruct *calc, int thread_cnt, int n_energy, long n_done, long n_total, double t_now, char *status)
+	{
+	FILE *fptr;
+	char f_tmp[110];
+	int i, j;
+	long istart=0, ienter=0, itrans=0;
+	double sum_cnt=0., trans, dt;
+	struct rusage usage;
+
+	for(i=0; i<thread_cnt; i++){
+		istart = istart + calc[i].istart;
+		ienter = ienter + calc[i].ienter;
+		itrans = itrans + calc[i].itrans;
+		for(j=0; j<=n_energy; j++) sum_cnt = sum_cnt + calc[i].cnt[j];
 		}
+	trans = (istart > 0) ? sum_cnt/(n_energy+1)/(double)istart : 0.;
+	getrusage(RUSAGE_SELF, &usage);
+	dt = t_now - telem->t_prev;
+	if(dt <= 0.) dt = 1.;
 
-
-	if(calc[*thread_id].iesc !=0){
-		calc[*thread_id].iesc = 1;
+	sprintf(f_tmp,"%s.tmp",telem->filename);
+	fptr = fopen(f_tmp,"w");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",f_tmp);
+		exit(0);
 		}
-		else //calc[*thread_id].iesc == 0
-		{
-		delta_traj[0] = rh1[0] - calc[*thread_id].rh[0];
-		delta_traj[1] = rh1[1] - calc[*thread_id].rh[1];
-		delta_traj[2] = rh1[2] + cap->d_source - calc[*thread_id].rh[2];
-		ds = sqrt(scalar(delta_traj,delta_traj));
-		calc[*thread_id].traj_length = calc[*thread_id].traj_length + ds;
-		//store new interaction coordinates in appropriate array
-		calc[*thread_id].rh[0] = rh1[0];
-		calc[*thread_id].rh[1] = rh1[1];
-		calc[*thread_id].rh[2] = rh1[2] + cap->d_source;
+	fprintf(fptr,"{\n");
+	fprintf(fptr,"  \"status\": \"%s\",\n",status);
+	fprintf(fptr,"  \"elapsed_s\": %.3f,\n",t_now);
+	fprintf(fptr,"  \"photons_done\": %ld,\n",n_done);
+	fprintf(fptr,"  \"photons_total\": %ld,\n",n_total);
+	fprintf(fptr,"  \"photons_per_s\": %.3f,\n",(t_now > 0.) ? n_done/t_now : 0.);
+	fprintf(fptr,"  \"eta_s\": %.1f,\n",(n_done > 0) ? t_now*(double)(n_total-n_done)/(double)n_done : -1.);
+	fprintf(fptr,"  \"started\": %ld,\n",istart);
+	fprintf(fptr,"  \"entered\": %ld,\n",ienter);
+	fprintf(fptr,"  \"transmitted\": %ld,\n",itrans);
+	fprintf(fptr,"  \"transmission\": %.9f,\n",trans);
+	fprintf(fptr,"  \"transmission_error\": %.9f,\n",(istart > 0) ? sqrt(trans/(double)istart) : 0.);
+	fprintf(fptr,"  \"max_rss_kb\": %ld,\n",(long)usage.ru_maxrss);
+	fprintf(fptr,"  \"threads\": [\n");
+	for(i=0; i<thread_cnt; i++){
+		fprintf(fptr,"    {\"id\": %d, \"started\": %ld, \"entered\": %ld, \"transmitted\": %ld, "
+			"\"started_per_s\": %.3f, \"entered_per_s\": %.3f, \"transmitted_per_s\": %.3f}%s\n",
+			i, calc[i].istart, calc[i].ienter, calc[i].itrans, (calc[i].istart-telem->prev[3*i])/dt,
+			(calc[i].ienter-telem->prev[3*i+1])/dt, (calc[i].itrans-telem->prev[3*i+2])/dt, (i < thread_cnt-1) ? "," : "");
+		telem->prev[3*i] = calc[i].istart;
+		telem->prev[3*i+1] = calc[i].ienter;
+		telem->prev[3*i+2] = calc[i].itrans;
+		}
+	fprintf(fptr,"  ]\n");
+	fprintf(fptr,"}\n");
+	fclose(fptr);
+	if(rename(f_tmp,telem->filename) != 0){
+		printf("Could not replace %s.\n",telem->filename);
+		exit(0);
+		}
+	telem->t_prev = t_now;
+	#pragma omp atomic write
+	telem->t_next = t_now + telem->interval;
 
-		if(fabs(calf) > 1.0){
-			printf("COS(alfa) > 1\n");
-			calc[*thread_id].iesc = -1;
-			}
-			else
-			{
-			alf = acos(calf);
-			alf = PI/(double)2 - alf;
-			w0 = calc[*thread_id].w[0];
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Look up the tuned thread count and chunk size of this machine and input in the cache file, or set up
+// the candidates to measure: thread counts doubling up to thread_max with the given chunk size, followed
+// by chunk sizes at the fastest thread count. Each candidate traces n_burst photons per thread, so that at
+// ideal scaling every burst takes the same time and all of them TUNE_SHARE of a run with thread_max threads.
+struct autotune *tune_open(char *filename, char *inp_name, struct inp_file *cap, struct cap_profile *profile, struct mumc *absmu, int thread_max, int chunk, long n_photon)
+	{
+	FILE *fptr;
+	struct autotune *tune;
+	char host[100], line[500];
+	int t, threads, chunk_size;
+	double rate;
 
-			calc[*thread_id].iesc = reflect(alf,cap,absmu,profile,leaks,calc,thread_id);
+	tune = malloc(sizeof(struct autotune));
+	if(tune == NULL){
+		printf("Could not allocate autotune memory.\n");
+		exit(0);
+		}
+	sprintf(tune->filename,"%.99s",filename);
+	if(gethostname(host,sizeof(host)) != 0) strcpy(host,"unknown");
+	host[sizeof(host)-1] = '\0';
+	sprintf(tune->key,"%s %d %.150s %d %d %.0f",host,omp_get_num_procs(),inp_name,absmu->n_energy,profile->nmax,cap->n_chan);
+	tune->cached = 0;
+	tune->n_cand = 0;
+	tune->i_cand = 0;
+	tune->best_threads = thread_max;
+	tune->best_chunk = chunk;
+	tune->best_rate = 0.;
 
-			if(calc[*thread_id].iesc != -2){
-				w1 = calc[*thread_id].w[0];
-				calc[*thread_id].absorb[calc[*thread_id].ix] = calc[*thread_id].absorb[calc[*thread_id].ix] + (double)(w0-w1);
+	//the last entry for this machine and input holds
+	fptr = fopen(filename,"r");
+	if(fptr != NULL){
+		while(fgets(line,sizeof(line),fptr) != NULL){
+			if(strncmp(line,tune->key,strlen(tune->key)) != 0 || line[strlen(tune->key)] != ' ') continue;
+			if(sscanf(&line[strlen(tune->key)],"%d %d %lf",&threads,&chunk_size,&rate) != 3 || threads < 1 || chunk_size < 0) continue;
+			tune->cached = 1;
+			tune->best_threads = (threads < thread_max) ? threads : thread_max;
+			tune->best_chunk = chunk_size;
+			tune->best_rate = rate;
+			}
+		fclose(fptr);
+		}
+	if(tune->cached){
+		printf("Autotune: %d threads, chunk %d from %s (%.1f photons/s)\n",tune->best_threads,tune->best_chunk,filename,tune->best_rate);
+		return tune;
+		}
 
-				salf2 = (double)2.*sin(alf);
-				calc[*thread_id].v[0] = calc[*thread_id].v[0] - salf2*rn[0];
-				calc[*thread_id].v[1] = calc[*thread_id].v[1] - salf2*rn[1];
-				calc[*thread_id].v[2] = calc[*thread_id].v[2] - salf2*rn[2];
+	for(t=1; t<thread_max && tune->n_cand < NTUNE-6; t=2*t){
+		tune->threads[tune->n_cand] = t;
+		tune->chunk[tune->n_cand] = chunk;
+		tune->n_cand++;
+		}
+	tune->threads[tune->n_cand] = thread_max;
+	tune->chunk[tune->n_cand] = chunk;
+	tune->n_cand++;
+	tune->n_thread_cand = tune->n_cand;
+	//4 chunk sizes follow
+	tune->n_burst = (long)(TUNE_SHARE*n_photon)/((tune->n_cand+4)*(long)thread_max);
+	if(tune->n_burst < 8){
+		printf("Autotune: too few photons to calibrate, using %d threads, chunk %d\n",tune->best_threads,tune->best_chunk);
+		tune->n_cand = 0;
+		return tune;
+		}
+	printf("Autotune: calibrating with %ld photons per thread and setting\n",tune->n_burst);
 
-				norm(calc[*thread_id].v, (int)3);
-				calc[*thread_id].i_refl++; //add a reflection
-				}
-			}
+	return tune;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Settings for the next photons: the next candidate to measure (returns 1), or the fastest (returns 0)
+int tune_next(struct autotune *tune, int *threads, int *chunk)
+	{
+	if(tune->i_cand < tune->n_cand){
+		*threads = tune->threads[tune->i_cand];
+		*chunk = tune->chunk[tune->i_cand];
+		return 1;
 		}
+	*threads = tune->best_threads;
+	*chunk = tune->best_chunk;
 
-	return;
+	return 0;
 	}
 // ---------------------------------------------------------------------------------------------------
-void count(struct mumc *absmu, struct inp_file *cap, int *icount, struct cap_profile *profile, struct leakstruct *leaks, struct image_struct *imstr, struct calcstruct *calc, int *thread_id)
+// Record that the current candidate traced n photons in t seconds. A thread count clearly slower than the
+// best one ends the thread counts, as doubling them further will not help. After the thread counts the
+// chunk sizes are added, after the last candidate the fastest setting is appended to the cache file.
+void tune_result(struct autotune *tune, long n, double t)
 	{
-	int i;
-	double cc; //distance between last interaction and capillary exit, divided by propagation vector in z
-	double xpend, ypend; //coordinates of photon at end of capillary if rendered unobstructed
-	float v_hex1[2], v_hex2[2], v_hex3[2]; //normal vectors of edges of hexagonal PC shape
-	float hex_edge_dist; //distance from PC centre to middle of hex edge (along normal on edge)
-	float dp1, dp2, dp3; //length of xpend and ypend projected on hex edge norm
-	double c; //distance between last interaction and screen position, divided by propagation vector in z
-	float xp, yp; //photon position on screen if rendered unobstructed
-	double delta_traj[3]; //photon trajectory from last interaction to screen
-	double ds; //distance between last interaction and screen
-	int ind_x, ind_y; //indices of spot array corresponding to photon coordinate on screen
+	FILE *fptr;
+	int k;
+	int chunk[4] = {0, 4, 16, 64}; //0 for a static schedule
 
-	//simulate hexagonal polycapillary housing
-	cc = ((cap->d_source+profile->cl)-calc[*thread_id].rh[2])/calc[*thread_id].v[2];
-	xpend  = calc[*thread_id].rh[0] + cc*calc[*thread_id].v[0];
-	ypend  = calc[*thread_id].rh[1] + cc*calc[*thread_id].v[1];
-	v_hex1[0] = 0; //vert hex edges x vector
-	v_hex1[1] = 1; //vert hex edges y vector
-	v_hex2[0] = cos(PI/6); //upper right and lower left edges x vector
-	v_hex2[1] = sin(PI/6); //upper right and lower left edges y vector
-	v_hex3[0] = cos(-1.*PI/6); //upper left and lower right edges x vector
-	v_hex3[1] = sin(-1.*PI/6); //upper left and lower right edges y vector
-	hex_edge_dist = sqrt(profile->rtot2 * profile->rtot2 - (profile->rtot2/2)*(profile->rtot2/2));
-	//calculate dot products and see if magnitude is > distance from centre to hex side
-	dp1 = fabs(v_hex1[0]*xpend + v_hex1[1]*ypend);
-	dp2 = fabs(v_hex2[0]*xpend + v_hex2[1]*ypend);
-	dp3 = fabs(v_hex3[0]*xpend + v_hex3[1]*ypend);
-	if(dp1 > hex_edge_dist || dp2 > hex_edge_dist || dp3 > hex_edge_dist){
-		//photon is outside of PC exit area
-		calc[*thread_id].iesc = -3;
+	printf("Autotune: %d threads, chunk %d: %.1f photons/s\n",tune->threads[tune->i_cand],tune->chunk[tune->i_cand],n/t);
+	if(n/t > tune->best_rate){
+		tune->best_rate = n/t;
+		tune->best_threads = tune->threads[tune->i_cand];
+		tune->best_chunk = tune->chunk[tune->i_cand];
 		}
-		else //photon inside PC exit area
-		{
-		for(i=0; i <= absmu->n_energy; i++){
-			calc[*thread_id].cnt[i] = calc[*thread_id].cnt[i] + calc[*thread_id].w[i];
-			if(calc[*thread_id].cnt[i] != calc[*thread_id].cnt[i]){
-				printf("thread: %d, icount: %d, cnt[%d]: %f, w[%d]: %f\n",
-					*thread_id,*icount,i,calc[*thread_id].cnt[i],i,calc[*thread_id].w[i]);
-				exit(0);
-				}
-			} //for(i=0; i <= absmu->n_energy; i++)
+	tune->i_cand++;
+	if(tune->i_cand < tune->n_thread_cand && n/t < TUNE_DROP*tune->best_rate){
+		printf("Autotune: skipping larger thread counts\n");
+		tune->i_cand = tune->n_thread_cand;
+		}
+	if(tune->i_cand == tune->n_thread_cand){
+		for(k=0; k<4; k++){
+			if(chunk[k] == tune->best_chunk) chunk[k] = 1;
+			tune->threads[tune->n_cand] = tune->best_threads;
+			tune->chunk[tune->n_cand] = chunk[k];
+			tune->n_cand++;
+			}
+		}
+	if(tune->i_cand < tune->n_cand) return;
 
-		c = (cap->d_screen - calc[*thread_id].rh[2]) / calc[*thread_id].v[2];
-		xp = (float)(calc[*thread_id].rh[0] + c*calc[*thread_id].v[0]);
-		yp = (float)(calc[*thread_id].rh[1] + c*calc[*thread_id].v[1]);
+	printf("Autotune: using %d threads, chunk %d (%.1f photons/s)\n",tune->best_threads,tune->best_chunk,tune->best_rate);
+	fptr = fopen(tune->filename,"a");
+	if(fptr == NULL){
+		printf("Could not open %s for writing.\n",tune->filename);
+		return;
+		}
+	fprintf(fptr,"%s %d %d %.1f\n",tune->key,tune->best_threads,tune->best_chunk,tune->best_rate);
+	fclose(fptr);
 
-		delta_traj[0] = c*calc[*thread_id].v[0];
-		delta_traj[1] = c*calc[*thread_id].v[1];
-		delta_traj[2] = c*calc[*thread_id].v[2];
-		ds = sqrt(scalar(delta_traj,delta_traj));
-		calc[*thread_id].traj_length = calc[*thread_id].traj_length + ds;
+	return;
+	}
+// ---------------------------------------------------------------------------------------------------
+// Local launcher: fork/exec n_launch worker processes of this program, each tracing a disjoint
+// photon range (-part k n_launch), and wait for all of them to finish
+void launch_workers(char *prog, char *inp_name, struct run_opts *opts)
+	{
+	int k, n, status, failed=0;
+	pid_t pid;
+	char part[16], n_part[16], threads[16], chunk[16], spot_bin[32], spot_ebin[3][32], qmc[16], ang_max[32], telemetry_dt[32];
+	char *args[40];
 
-		ind_x = (int)floor(xp/profile->binsize)+NSPOT/2;
-		ind_y = (int)floor(yp/profile->binsize)+NSPOT/2;
-		if(ind_x < NSPOT && ind_x >= 0){
-			if(ind_y < NSPOT && ind_y >= 0){
-				leaks->spot[ind_x][ind_y] = leaks->spot[ind_x][ind_y] + calc[*thread_id].w[0];
-				}
+	for(k=0; k<opts->n_launch; k++){
+		sprintf(part,"%d",k);
+		sprintf(n_part,"%d",opts->n_launch);
+		sprintf(threads,"%d",opts->thread_cnt);
+		args[0] = prog;
+		args[1] = inp_name;
+		args[2] = "-part";
+		args[3] = part;
+		args[4] = n_part;
+		args[5] = "-threads";
+		args[6] = threads;
+		sprintf(chunk,"%d",opts->chunk);
+		args[7] = "-chunk";
+		args[8] = chunk;
+		n = 9;
+		//settings that change the partial result layout
+		sprintf(spot_bin,"%.17g",opts->spot_bin);
+		if(opts->spot_bin > 0.){
+			args[n++] = "-spot_bin";
+			args[n++] = spot_bin;
 			}
-
-		if(*icount <= IMSIZE-1){
-			imstr[*icount].xm = yp;
-			imstr[*icount].ym = xp;
-			imstr[*icount].xm1 = (float)calc[*thread_id].v[1];
-			imstr[*icount].ym1 = (float)calc[*thread_id].v[0];
-			imstr[*icount].warr = calc[*thread_id].w[0];
+		if(opts->spot_energy && opts->spot_de > 0.){
+			sprintf(spot_ebin[0],"%.17g",opts->spot_emin);
+			sprintf(spot_ebin[1],"%.17g",opts->spot_emax);
+			sprintf(spot_ebin[2],"%.17g",opts->spot_de);
+			args[n++] = "-spot_ebin";
+			args[n++] = spot_ebin[0];
+			args[n++] = spot_ebin[1];
+			args[n++] = spot_ebin[2];
+			} else if(opts->spot_energy) args[n++] = "-spot_energy";
+		if(opts->screens != NULL){
+			args[n++] = "-screens";
+			args[n++] = opts->screens;
 			}
-		} //if(dp1 > hex_edge_dist || dp2 > hex_edge_dist || dp3 > hex_edge_dist) ... else ...
+		if(opts->hexsym) args[n++] = "-hexsym";
+		if(opts->generic) args[n++] = "-generic";
+		if(opts->nospot) args[n++] = "-nospot";
+		if(opts->ang_max > 0.){
+			sprintf(ang_max,"%.17g",opts->ang_max);
+			args[n++] = "-ang_max";
+			args[n++] = ang_max;
+			}
+		if(opts->response != NULL){
+			args[n++] = "-response";
+			args[n++] = opts->response;
+			}
+		if(opts->source != NULL){
+			args[n++] = "-source";
+			args[n++] = opts->source;
+			args[n++] = opts->source_p1;
+			args[n++] = opts->source_p2;
+			}
+		if(opts->source_ang != NULL){
+			args[n++] = "-source_ang";
+			args[n++] = opts->source_ang;
+			}
+		if(opts->qmc > 0){
+			sprintf(qmc,"%d",opts->qmc);
+			args[n++] = "-qmc";
+			args[n++] = qmc;
+			}
+		//every worker writes its own snapshot file
+		if(opts->telemetry != NULL){
+			sprintf(telemetry_dt,"%.17g",opts->telemetry_dt);
+			args[n++] = "-telemetry";
+			args[n++] = opts->telemetry;
+			args[n++] = telemetry_dt;
+			}
+		args[n] = NULL;
+		pid = fork();
+		if(pid < 0){
+			printf("Could not fork worker process %d.\n",k);
+			exit(0);
+			}
+		if(pid == 0){
+			execvp(prog,args);
+			printf("Could not start worker process %s.\n",prog);
+			_exit(1);
+			}
+		}
+	for(k=0; k<opts->n_launch; k++){
+		if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+		}
+	if(failed > 0){
+		printf("%d worker process(es) failed.\n",failed);
+		exit(0);
+		}
+
 	return;
 	}
 // ---------------------------------------------------------------------------------------------------
@@ -872,45 +5072,83 @@ int main(int argc, char *argv[])
 	struct image_struct *imstr;
 	struct countvars *ctvar;
 	struct calcstruct *calc;
-	long *sum_irefl;
 	double *absorb_sum;
-	float*sum_cnt;
+	double *sum_cnt; //transmitted photon weight per energy
 	const gsl_rng_type *T = gsl_rng_mt19937; //Mersenne twister rng
-	double *seed; //holds unique seeds for each thread
 	int icount=0, thread_id=0;
 	long sum_refl=0, sum_istart=0, sum_ienter=0; //amount of reflected, started and entered photons
-	float ave_refl; //average amount of reflections
+	double ave_refl; //average amount of reflections
 	FILE *fptr; //pointer to access files
 	float e=0;
 	float dist=0;
-	char f_abs[100];
 	int arrsize=0;
 	double new_seed;
+	struct run_opts opts;
+	char f_part[100];
+	int k, n_part_files;
+	int icount_lo, icount_hi; //photon range traced by this process
+	int nspot; //amount of bins along x and y in the written spot maps
+	long n_done=0, n_done_local, n_report; //photons completed by all threads, progress report interval
+	long n_count=0; //transmitted photons in a re-weighted history
+	struct hist_file *hist=NULL;
+	struct hist_file *exitw=NULL;
+	struct qmc_sampler *qmc=NULL;
+	struct wave_pool *wave=NULL; //wall waviness slope fields
+	struct telemetry *telem=NULL; //periodic run snapshots
+	struct autotune *tune=NULL; //thread count and chunk size calibration
+	struct zcache *zcache=NULL; //z-plane cache being recorded or resumed
+	int run_threads, run_chunk, tuning; //settings of the current photons, which are a calibration burst
+	int icount_next, burst_hi; //photon range traced with these settings
+	double t_burst; //wall clock time at its start
+	double *qcnt; //transmitted weight per quasi-random replicate and energy
+	long *qstart; //started photons per quasi-random replicate
+	double t_start, t_now, t_first; //wall clock time
+	trace_func trace; //tracing kernel specialised for this setup
+	struct resp_table *resp=NULL; //response table evaluated instead of tracing, or the recorded one
+	int k_flags; //its K_* flags
 
 	// Check whether input file argument was supplied
 	if(argc <= 1){
-		printf("Usage: polycap input-file should be supplied.\n");
+		printf("Usage: polycap input-file [-threads n] [-part k n] [-launch n] [-merge partial-files...] should be supplied.\n");
 		exit(0);
 		}
+	opts = read_run_opts(argc, argv);
 
 	// Check maximal amount of threads and let user choose the amount of threads to use
 //	#pragma omp parallel
 //		{
 		thread_max = omp_get_max_threads();
 //		}
-	printf("Type in the amount of threads to use (max %d):\n",thread_max);
-	scanf("%d",&thread_cnt);
-	printf("%d threads out of %d selected.\n",thread_cnt, thread_max);
+	if(opts.n_merge == 0 && opts.reweight == NULL && opts.fold == NULL && opts.compare == NULL){
+		thread_cnt = opts.thread_cnt;
+		if(thread_cnt <= 0 && opts.autotune != NULL) thread_cnt = thread_max;
+		if(thread_cnt <= 0){
+			printf("Type in the amount of threads to use (max %d):\n",thread_max);
+			scanf("%d",&thread_cnt);
+			opts.thread_cnt = thread_cnt;
+			}
+		printf("%d threads out of %d selected.\n",thread_cnt, thread_max);
+		}
 
 	// Read *.inp file and save all information in cap structure;
 	printf("Reading input file...");
 	cap = read_cap_data(argv[1]);
+	read_screens(opts.screens,&cap);
+	if(opts.ang_max > 0.) cap.ang_max = opts.ang_max;
+	cap.spots = !opts.nospot;
 	printf("   OK\n");
+
+	// Compare the outputs of two runs of this input file instead of tracing photons
+	if(opts.compare != NULL) return compare(opts.compare, opts.compare_test, &cap);
 	
 	// Read capillary profile file;
 	printf("Reading capillary profile files...\n");
 	profile = read_cap_profile(&cap);
 	printf("Capillary profiles read.\n");
+	ini_hexsym(&cap,profile,&opts);
+	if(opts.spot_bin > 0.) profile->binsize = opts.spot_bin;
+	nspot = NSPOT;
+	if(opts.spot_size > 0.) nspot = (int)ceil(opts.spot_size/profile->binsize);
 
 	// Read library files;
 	printf("Reading library files...\n");
@@ -919,9 +5157,135 @@ int main(int argc, char *argv[])
 
 	//Initialize
 	absmu = ini_mumc(&cap);
-	leaks = reset_leak(profile,absmu);
+	ini_spot_layers(&cap,absmu,&opts);
+	leaks = reset_leak(&cap,profile,absmu);
 	pcap_ini = ini_polycap(&cap,profile);
 
+	// Fold recorded exit weights with a source spectrum and filters instead of tracing photons
+	if(opts.fold != NULL){
+		printf("Folding exit weights %s with spectrum %s\n",opts.fold,opts.spectrum);
+		fold(opts.fold, opts.spectrum, opts.filters, &cap, nspot);
+		free(profile->arr);
+		free(profile->shape);
+		free(profile);
+		free(absmu->arr);
+		free(absmu);
+		free_leak(&cap,leaks);
+		return 0;
+		}
+
+	// Distributed run: start the workers locally and/or combine their partial results,
+	// or re-weight a recorded bounce history instead of tracing photons
+	if(opts.n_launch > 0 || opts.n_merge > 0 || opts.reweight != NULL){
+		if(opts.reweight != NULL){
+			n_part_files = 0;
+			} else if(opts.n_launch > 0){
+			printf("Launching %d worker processes...\n",opts.n_launch);
+			launch_workers(argv[0], argv[1], &opts);
+			n_part_files = opts.n_launch;
+			} else n_part_files = opts.n_merge;
+		absorb_sum = malloc(sizeof(*absorb_sum)*(profile->nmax+1));
+		sum_cnt = malloc(sizeof(*sum_cnt)*(absmu->n_energy+1));
+		if(absorb_sum == NULL || sum_cnt == NULL){
+			printf("Could not allocate merge memory.\n");
+			exit(0);
+			}
+		for(j=0; j<=profile->nmax; j++) absorb_sum[j] = (double)0.;
+		for(j=0; j<=absmu->n_energy; j++) sum_cnt[j] = 0.;
+		for(k=0; k<n_part_files; k++){
+			if(opts.n_launch > 0) sprintf(f_part,"%s.part%d",cap.out,k);
+				else sprintf(f_part,"%.99s",opts.merge[k]);
+			printf("Merging %s\n",f_part);
+			add_partial(f_part, &cap, absmu, profile, leaks, sum_cnt, absorb_sum, &sum_istart, &sum_ienter, &sum_refl);
+			}
+		ave_refl = (double)sum_refl/(double)cap.ndet;
+		if(opts.reweight != NULL){
+			printf("Re-weighting bounce history %s\n",opts.reweight);
+			reweight(opts.reweight, &cap, profile, absmu, leaks, sum_cnt, absorb_sum, &sum_istart, &sum_ienter, &sum_refl, &n_count,
+				opts.thread_cnt > 0 ? opts.thread_cnt : thread_max);
+			ave_refl = (double)sum_refl/(double)n_count;
+			}
+		printf("Average number of reflections: %f\n",ave_refl);
+		if(!opts.nospot) write_spot_files(&cap,absmu,leaks,nspot);
+		write_out(argv[1], &cap, profile, &pcap_ini, absmu, leaks, sum_cnt, absorb_sum, sum_istart, sum_ienter, ave_refl);
+		write_stats(&cap, absmu, leaks);
+		//advance random.dat past the streams of the workers, so a repeated distributed run is independent;
+		//with an external launcher (-part k n) this needs -merge to run where the workers read random.dat
+		if(opts.n_launch > 0 || opts.n_merge > 0){
+			lib = read_library_files(&cap);
+			new_seed = part_seed(lib.rseed,n_part_files);
+			fptr = fopen("random.dat","w");
+			fprintf(fptr,"%lf\n",new_seed);
+			printf("New seed: %lf\n",new_seed);
+			fclose(fptr);
+			}
+		free(absorb_sum);
+		free(sum_cnt);
+		free(profile->arr);
+		free(profile->shape);
+		free(profile);
+		free(absmu->arr);
+		free(absmu);
+		free_leak(&cap,leaks);
+		return 0;
+		}
+	// Worker of a distributed run: trace only its own share of the photons, with its own rng stream
+	icount_lo = (int)((long)(cap.ndet+1)*opts.part/opts.n_part);
+	icount_hi = (int)((long)(cap.ndet+1)*(opts.part+1)/opts.n_part);
+	cap.source = source_alloc(&opts);
+	if(cap.source != NULL && cap.source->type == SRC_GAUSS) printf("Gaussian source, rms widths %g x %g cm\n",cap.source->a,cap.source->b);
+	if(cap.source != NULL && cap.source->type == SRC_ELLIPSE) printf("Elliptical source, semi-axes %g x %g cm\n",cap.source->a,cap.source->b);
+	if(cap.source != NULL && cap.source->type == SRC_IMAGE) printf("Source image %s, %d x %d pixels of %g cm\n",opts.source_p1,cap.source->nx,cap.source->ny,cap.source->a);
+	if(cap.source != NULL && cap.source->n_ang > 0) printf("Angular emission profile %s up to %g rad\n",opts.source_ang,cap.source->ang_max);
+	//a resumed run traces every cached photon instead
+	if(opts.zcache_out != NULL || opts.zcache_in != NULL){
+		if(profile->shape != NULL || cap.sig_wave > 0.){
+			printf("Z-plane caches need a tabulated capillary profile without wall waviness.\n");
+			exit(0);
+			}
+		if(opts.zcache_out != NULL){
+			zcache = zcache_open(opts.zcache_out, opts.zcache_z, &cap, profile, absmu);
+			} else {
+			zcache = zcache_read(opts.zcache_in, &cap, profile, absmu, leaks, &sum_istart, &sum_ienter);
+			icount_lo = 0;
+			icount_hi = (int)zcache->n_state;
+			}
+		}
+	if(opts.autotune != NULL){
+		tune = tune_open(opts.autotune, argv[1], &cap, profile, absmu, thread_cnt, opts.chunk, icount_hi-icount_lo);
+		if(tune->cached) thread_cnt = tune->best_threads;
+		}
+	//all workers share the scrambling of the quasi-random replicates
+	if(opts.qmc > 0){
+		qmc = qmc_alloc(opts.qmc, lib.rseed, &pcap_ini);
+		printf("Quasi-random sampling with %d replicates\n",opts.qmc);
+		}
+	if(opts.response != NULL) resp = resp_read(opts.response, &cap, profile, absmu);
+	//all workers share the waviness of the channels
+	if(cap.sig_wave > 0.){
+		wave = wave_alloc(&cap, profile, lib.rseed);
+		printf("Wall waviness %g cm rms over %g cm\n",cap.sig_wave,cap.corr_length);
+		}
+	if(opts.n_part > 1) lib.rseed = part_seed(lib.rseed,opts.part);
+	if(opts.history != NULL){
+		if(opts.n_part > 1) sprintf(f_part,"%.90s.part%d",opts.history,opts.part);
+			else sprintf(f_part,"%.99s",opts.history);
+		hist = hist_open(f_part, &cap, profile);
+		printf("Recording bounce histories in %s\n",f_part);
+		}
+	if(opts.exitw != NULL){
+		if(opts.n_part > 1) sprintf(f_part,"%.90s.part%d",opts.exitw,opts.part);
+			else sprintf(f_part,"%.99s",opts.exitw);
+		exitw = exitw_open(f_part, &cap, profile, absmu);
+		printf("Recording exit weights in %s\n",f_part);
+		}
+	if(opts.telemetry != NULL){
+		if(opts.n_part > 1) sprintf(f_part,"%.90s.part%d",opts.telemetry,opts.part);
+			else sprintf(f_part,"%.99s",opts.telemetry);
+		telem = telemetry_open(f_part, opts.telemetry_dt, thread_cnt);
+		printf("Writing run snapshots to %s every %g s\n",f_part,opts.telemetry_dt);
+		}
+
 	//allocate memory to imstr
 	imstr = malloc(sizeof(struct image_struct)*IMSIZE);
 	if(imstr == NULL){
@@ -961,21 +5325,7 @@ int main(int argc, char *argv[])
 	// (can't use private command because this command does not handle pointers well, so instead
 	// we create seperate variables for each thread (which they can use separatly based on their
 	// thread_id) and will recombine them afterwards if needed)
-	calc = malloc(sizeof(struct calcstruct)*thread_cnt);	
-	if(calc == NULL){
-		printf("Could not allocate calc memory.\n");
-		exit(0);
-		}
-	sum_irefl = malloc(sizeof(*sum_irefl)*thread_cnt);
-	if(sum_irefl == NULL){
-		printf("Could not allocate sum_irefl memory.\n");
-		exit(0);
-		}
-	seed = malloc(sizeof(*seed)*thread_cnt);
-	if(seed == NULL){
-		printf("Could not allocate seed memory.\n");
-		exit(0);
-		}
+	calc = alloc_calc(thread_cnt);
 	absorb_sum = malloc(sizeof(*absorb_sum)*(profile->nmax+1));
 	if(absorb_sum == NULL){
 		printf("Could not allocate absorb_sum memory.\n");
@@ -986,89 +5336,209 @@ int main(int argc, char *argv[])
 		printf("Could not allocate sum_cnt memory.\n");
 		exit(0);
 		}
-	for(i=0;i<thread_cnt;i++){
-		/*give arrays inside calc struct appropriate dimensions*/
-		calc[i].sx = malloc(sizeof(*calc[i].sx)*(profile->nmax+1));
-		if(calc[i].sx == NULL){
-			printf("Could not allocate calc[].sx memory.\n");
-			exit(0);
-			}
-		calc[i].sy = malloc(sizeof(*calc[i].sy)*(profile->nmax+1));
-		if(calc[i].sy == NULL){
-			printf("Could not allocate calc[].sy memory.\n");
-			exit(0);
-			}
-		calc[i].absorb = malloc(sizeof(*calc[i].absorb)*(profile->nmax+1));
-		if(calc[i].absorb == NULL){
-			printf("Could not allocate calc[].absorb memory.\n");
-			exit(0);
-			}
-		calc[i].w = malloc(sizeof(*calc[i].w)*(absmu->n_energy+1));
-		if(calc[i].w == NULL){
-			printf("Could not allocate calc[].w memory.\n");
-			exit(0);
-			}
-		calc[i].cnt = malloc(sizeof(*calc[i].cnt)*(absmu->n_energy+1));
-		if(calc[i].cnt == NULL){
-			printf("Could not allocate calc[].cnt memory.\n");
-			exit(0);
-			}
-		/*copy correct values into corresponding calc struct variable*/
-		calc[i].i_refl = ctvar->i_refl;
-		calc[i].istart = ctvar->istart;
-		calc[i].ienter = ctvar->ienter;
-		calc[i].traj_length = ctvar->traj_length;
-		calc[i].phase = ctvar->phase;
-		calc[i].amplitude = ctvar->amplitude;
-		calc[i].iesc = *iesc;
-		calc[i].ix = 0.;
-		sum_irefl[i] = (long)0.;
-		for(j=0;j<3;j++){
-			calc[i].rh[j] = ctvar->rh[j];
-			calc[i].v[j] = ctvar->v[j];
-			}
-		for(j=0; j<=profile->nmax; j++){
-			calc[i].sx[j] = profile->arr[j].sx;
-			calc[i].sx[j] = profile->arr[j].sy;
-			calc[i].absorb[j] = (double)0.;
-			absorb_sum[j] = (double)0.;
-			}
-		for(j=0; j<=absmu->n_energy;j++){
-			calc[i].cnt[j] = (float)0.;
-			sum_cnt[j] = (float)0.;
-			calc[i].w[j] = ctvar->w[j];
-			}
-		//Give each thread unique rng range.
-		calc[i].rn = gsl_rng_alloc(T);
-		if(i == 0){
-			gsl_rng_set(calc[i].rn,lib.rseed);
-			} else {
-			gsl_rng_set(calc[i].rn,seed[i-1]);
+	for(j=0; j<=profile->nmax; j++) absorb_sum[j] = (double)0.;
+	for(j=0; j<=absmu->n_energy;j++) sum_cnt[j] = 0.;
+	//Each thread allocates and initialises its own state, so on NUMA machines it ends up in the memory
+	//of the node the thread runs on (first touch). Threads should be bound (OMP_PROC_BIND) for this to last.
+	#pragma omp parallel private(i,j) num_threads(thread_cnt)
+		{
+		//one calc[] per loop index with a chunk of 1, so in a full team thread i touches calc[i]; a smaller
+		//team (OMP_THREAD_LIMIT, OMP_DYNAMIC, nesting) still initialises every calc[]
+		#pragma omp for schedule(static,1)
+		for(i=0; i<thread_cnt; i++){
+			/*give arrays inside calc struct appropriate dimensions*/
+			calc[i].sx = malloc(sizeof(*calc[i].sx)*(profile->nmax+1));
+			if(calc[i].sx == NULL){
+				printf("Could not allocate calc[].sx memory.\n");
+				exit(0);
+				}
+			calc[i].sy = malloc(sizeof(*calc[i].sy)*(profile->nmax+1));
+			if(calc[i].sy == NULL){
+				printf("Could not allocate calc[].sy memory.\n");
+				exit(0);
+				}
+			calc[i].absorb = malloc(sizeof(*calc[i].absorb)*(profile->nmax+1));
+			if(calc[i].absorb == NULL){
+				printf("Could not allocate calc[].absorb memory.\n");
+				exit(0);
+				}
+			calc[i].w = malloc(sizeof(*calc[i].w)*(absmu->n_energy+1));
+			if(calc[i].w == NULL){
+				printf("Could not allocate calc[].w memory.\n");
+				exit(0);
+				}
+			calc[i].cnt = malloc(sizeof(*calc[i].cnt)*(absmu->n_energy+1));
+			if(calc[i].cnt == NULL){
+				printf("Could not allocate calc[].cnt memory.\n");
+				exit(0);
+				}
+			calc[i].leaks = reset_leak(&cap,profile,absmu);
+			calc[i].hist = hist;
+			calc[i].bounce = NULL;
+			calc[i].hbuf = NULL;
+			calc[i].n_bounce = 0;
+			calc[i].n_hbuf = 0;
+			if(hist != NULL){
+				calc[i].max_bounce = 64;
+				calc[i].bounce = malloc(sizeof(struct hist_bounce)*calc[i].max_bounce);
+				calc[i].max_hbuf = HIST_BUF;
+				calc[i].hbuf = malloc(calc[i].max_hbuf);
+				if(calc[i].bounce == NULL || calc[i].hbuf == NULL){
+					printf("Could not allocate calc[] history memory.\n");
+					exit(0);
+					}
+				}
+			calc[i].qmc = qmc;
+			calc[i].n_u = 0;
+			calc[i].qmc_rep = 0;
+			calc[i].qcnt = NULL;
+			calc[i].qstart = NULL;
+			if(qmc != NULL){
+				calc[i].qcnt = calloc(qmc->n_rep*(absmu->n_energy+1),sizeof(*calc[i].qcnt));
+				calc[i].qstart = calloc(qmc->n_rep,sizeof(*calc[i].qstart));
+				if(calc[i].qcnt == NULL || calc[i].qstart == NULL){
+					printf("Could not allocate calc[] qmc memory.\n");
+					exit(0);
+					}
+				}
+			calc[i].exitw = exitw;
+			calc[i].ebuf = NULL;
+			calc[i].n_ebuf = 0;
+			if(exitw != NULL){
+				calc[i].ebuf = malloc(HIST_BUF + (absmu->n_energy+3)*sizeof(float));
+				if(calc[i].ebuf == NULL){
+					printf("Could not allocate calc[] exit weight memory.\n");
+					exit(0);
+					}
+				}
+			/*copy correct values into corresponding calc struct variable*/
+			calc[i].i_refl = ctvar->i_refl;
+			calc[i].istart = ctvar->istart;
+			calc[i].ienter = ctvar->ienter;
+			calc[i].traj_length = ctvar->traj_length;
+			calc[i].phase = ctvar->phase;
+			calc[i].amplitude = ctvar->amplitude;
+			calc[i].iesc = *iesc;
+			calc[i].ix = 0.;
+			calc[i].sum_refl = 0;
+			calc[i].itrans = 0;
+			for(j=0;j<3;j++){
+				calc[i].rh[j] = ctvar->rh[j];
+				calc[i].v[j] = ctvar->v[j];
+				}
+			for(j=0; j<=profile->nmax; j++){
+				calc[i].sx[j] = profile->arr[j].sx;
+				calc[i].sx[j] = profile->arr[j].sy;
+				calc[i].absorb[j] = (double)0.;
+				}
+			for(j=0; j<=absmu->n_energy;j++){
+				calc[i].cnt[j] = 0.;
+				calc[i].w[j] = ctvar->w[j];
+				}
+			calc[i].rn = gsl_rng_alloc(T);
+			calc[i].resp = (opts.response_out != NULL) ? resp_alloc(&cap, profile, absmu) : resp;
+			calc[i].wave = wave;
+			calc[i].chan_map = opts.chanmap ? chan_alloc(&pcap_ini, absmu) : NULL;
+			calc[i].wave_field = NULL;
+			calc[i].zcache = zcache;
+			calc[i].zbuf = NULL;
+			calc[i].n_zbuf = 0;
+			if(opts.zcache_out != NULL){
+				calc[i].zbuf = malloc(HIST_BUF);
+				if(calc[i].zbuf == NULL){
+					printf("Could not allocate calc[] z-plane cache memory.\n");
+					exit(0);
+					}
+				}
+			calc[i].t_end = 0.;
 			}
-		seed[i] = gsl_rng_uniform(calc[i].rn)*lib.rseed;//create rn and multiply with original seed
-		gsl_rng_set(calc[i].rn,seed[i]);
 		}
-
 	//Actual multi-core loop where the calculations happen.
-	#pragma omp parallel for private(icount,thread_id,i) firstprivate(cap,profile,absmu,leaks,pcap_ini,thread_cnt) shared(calc,sum_irefl,imstr) num_threads(thread_cnt)
-	for(icount=0; icount <= cap.ndet; icount++){
-		thread_id = omp_get_thread_num();
-		do{
-			do{
-				start(absmu, profile, &pcap_ini, &cap, &icount, imstr, calc, &thread_id);
-				do{
-					capil(absmu, profile, &cap, leaks, calc, &thread_id);
-					} while(calc[thread_id].iesc == 0);
-				} while(calc[thread_id].iesc == -2);
-			count(absmu, &cap, &icount, profile, leaks, imstr,calc, &thread_id);
-			} while(calc[thread_id].iesc == -3);
-		sum_irefl[thread_id] = sum_irefl[thread_id] + calc[thread_id].i_refl;
-		if(thread_id == 0 && (float)i/((float)cap.ndet/(float)thread_cnt/10.) >= 1.){
-			printf("%d%%\t%ld\t%f\n",((icount*100)/(cap.ndet/thread_cnt)),calc[0].i_refl,calc[0].rh[2]);
-			i=0;
-			}
-		i++;//counter just to follow % completed
-		} //for(icount=0; icount <= cap.ndet; icount++)
+	//Photon histories differ wildly in cost, so they are handed out in chunks of -chunk n (16) to whichever
+	//thread is free (dynamic schedule); -chunk 0 gives every thread a fixed share (static schedule) instead.
+	//Every photon draws from its own rng stream (photon_seed), so the output does not depend on which
+	//thread traced it and a multi-threaded run is reproducible for a given random.dat either way.
+	trace = select_kernel(&opts, &k_flags);
+	if(opts.zcache_out != NULL){
+		trace = trace_zrecord;
+		printf("Caching photon states at z = %f cm in %s\n",zcache->z_plane,opts.zcache_out);
+		} else if(opts.zcache_in != NULL){
+		trace = trace_zresume;
+		printf("Resuming %ld cached photons at z = %f cm from %s\n",zcache->n_state,zcache->z_plane,opts.zcache_in);
+		} else if(opts.response_out != NULL){
+		trace = trace_record;
+		printf("Recording response table %s\n",opts.response_out);
+		} else if(resp != NULL){
+		trace = trace_lookup;
+		printf("Evaluating response table %s\n",opts.response);
+		} else if(k_flags & K_GENERIC) printf("Tracing kernel: generic\n");
+		else printf("Tracing kernel: %s\n",(k_flags & K_SPOTS) ? "spot maps" : "no spot maps");
+	n_report = (icount_hi-icount_lo)/10;
+	if(n_report < 1) n_report = 1;
+	t_start = omp_get_wtime();
+	//with the autotuner the first photons are traced in bursts with each of the candidate settings
+	run_threads = thread_cnt;
+	run_chunk = opts.chunk;
+	for(icount_next=icount_lo; icount_next < icount_hi; icount_next=burst_hi){
+		burst_hi = icount_hi;
+		tuning = (tune != NULL) ? tune_next(tune, &run_threads, &run_chunk) : 0;
+		if(tuning && icount_next+tune->n_burst*run_threads < icount_hi) burst_hi = icount_next+tune->n_burst*run_threads;
+		if(run_chunk > 0) omp_set_schedule(omp_sched_dynamic,run_chunk);
+			else omp_set_schedule(omp_sched_static,0);
+		t_burst = omp_get_wtime();
+		#pragma omp parallel private(icount,thread_id,n_done_local) firstprivate(cap,profile,absmu,pcap_ini,thread_cnt) shared(calc,imstr,n_done,trace,telem) num_threads(run_threads)
+			{
+			thread_id = omp_get_thread_num();
+			#pragma omp for schedule(runtime) nowait
+			for(icount=icount_next; icount < burst_hi; icount++){
+				if(qmc != NULL){
+					calc[thread_id].qmc_rep = icount % qmc->n_rep;
+					qmc_point(qmc, icount/qmc->n_rep+1, calc[thread_id].qmc_rep, calc[thread_id].u);
+					calc[thread_id].n_u = NQMC;
+					}
+				gsl_rng_set(calc[thread_id].rn,photon_seed(lib.rseed,icount));
+				trace(absmu, profile, &pcap_ini, &cap, &icount, imstr, calc, &thread_id);
+				calc[thread_id].sum_refl = calc[thread_id].sum_refl + calc[thread_id].i_refl;
+				//lock-free progress counter, the thread completing each 10% reports
+				#pragma omp atomic capture
+				n_done_local = ++n_done;
+				if(n_done_local % n_report == 0){
+					double t_report = omp_get_wtime() - t_start; //wall clock time of this report, private to the thread
+					printf("%ld%%\t%ld\t%f\tETA: %.0f s\n",(n_done_local*100+(icount_hi-icount_lo)/2)/(icount_hi-icount_lo),calc[thread_id].i_refl,
+						calc[thread_id].rh[2], t_report*(double)(icount_hi-icount_lo-n_done_local)/(double)n_done_local);
+					}
+				//whichever thread passes the snapshot time first writes it; t_next is read atomically as the
+				//writing thread updates it
+				if(telem != NULL){
+					double t_snap; //time of the next snapshot
+					#pragma omp atomic read
+					t_snap = telem->t_next;
+					if(omp_get_wtime() - t_start >= t_snap){
+						#pragma omp critical(telemetry)
+						{
+						if(omp_get_wtime() - t_start >= telem->t_next)
+							telemetry_write(telem, calc, thread_cnt, absmu->n_energy, n_done, icount_hi-icount_lo, omp_get_wtime() - t_start, "running");
+						}
+						}
+					}
+				} //for(icount=icount_next; icount < burst_hi; icount++)
+			calc[thread_id].t_end = omp_get_wtime() - t_start;
+			}
+		if(tuning) tune_result(tune, burst_hi-icount_next, omp_get_wtime()-t_burst);
+		}
+	//load balance: time between the first and last thread running out of photons
+	t_first = calc[0].t_end;
+	t_now = calc[0].t_end;
+	for(i=1; i<run_threads; i++){
+		if(calc[i].t_end <= 0.) continue; //not in the team the runtime gave
+		if(calc[i].t_end < t_first) t_first = calc[i].t_end;
+		if(calc[i].t_end > t_now) t_now = calc[i].t_end;
+		}
+	printf("Threads finished after %.2f - %.2f s (idle tail %.1f%%)\n",t_first,t_now,(t_now > 0.) ? (t_now-t_first)/t_now*100. : 0.);
+	if(telem != NULL){
+		telemetry_write(telem, calc, thread_cnt, absmu->n_energy, n_done, icount_hi-icount_lo, t_now, "finished");
+		telemetry_close(telem);
+		}
 
 
 	for(i=0; i<thread_cnt; i++){
@@ -1078,101 +5548,104 @@ int main(int argc, char *argv[])
 		for(j=0; j <= profile->nmax; j++){
 			absorb_sum[j] = absorb_sum[j] + calc[i].absorb[j];
 			}
+		for(j=0; j <= absmu->n_energy; j++){
+			leaks->leak[j] = leaks->leak[j] + calc[i].leaks->leak[j];
+			}
+		spot_merge(leaks->spot,calc[i].leaks->spot);
+		spot_merge(leaks->lspot,calc[i].leaks->lspot);
+		for(j=0; j<cap.n_screen; j++){
+			spot_merge(leaks->zspot[j],calc[i].leaks->zspot[j]);
+			spot_merge(leaks->zlspot[j],calc[i].leaks->zlspot[j]);
+			}
+		stats_merge(leaks,calc[i].leaks);
 		sum_istart = sum_istart + calc[i].istart;
 		sum_ienter = sum_ienter + calc[i].ienter;
-		sum_refl = sum_refl + sum_irefl[i];
+		sum_refl = sum_refl + calc[i].sum_refl;
+		if(hist != NULL) hist_flush(&calc[i]);
+		if(exitw != NULL) exitw_flush(&calc[i]);
+		if(opts.zcache_out != NULL) zcache_flush(&calc[i]);
 		}
+	if(opts.zcache_in != NULL){
+		for(j=0; j<zcache->i_plane; j++) absorb_sum[j] = absorb_sum[j] + zcache->absorb[j];
+		}
+	if(hist != NULL) hist_close(hist, sum_istart, sum_ienter);
+	if(exitw != NULL) hist_close(exitw, sum_istart, sum_ienter);
 
-	ave_refl = (float)sum_refl/(float)cap.ndet;
+	ave_refl = (double)sum_refl/(double)cap.ndet;
 	printf("Average number of reflections: %f\n",ave_refl);
 
 
 	// Output writing
-	fptr = fopen("xy.dat","w"); //stores coordinates of photon on screen(xm, ym), as well as direction(xm1,ym1)
-	if(IMSIZE > cap.ndet) arrsize = cap.ndet+1;
-		 else arrsize = IMSIZE;
-	fprintf(fptr,"%d\n",arrsize);
-	fprintf(fptr,"%f\n",e);
-	fprintf(fptr,"%f\n",cap.e_start);
-	fprintf(fptr,"%f\n",dist);
-	for(i=0; i<arrsize; i++){
-		fprintf(fptr,"%f\t%f\t%f\t%f\t%f\n",imstr[i].xm,imstr[i].xm1,imstr[i].ym,imstr[i].ym1,imstr[i].warr);
-		}
-	fclose(fptr);
+	if(opts.zcache_out != NULL){ //only the z-plane cache
+		printf("%ld photon states cached in %s\n",zcache->n_state,opts.zcache_out);
+		zcache_close(zcache, &cap, absmu, leaks, absorb_sum, sum_istart, sum_ienter);
+		zcache = NULL;
+		} else if(opts.response_out != NULL){ //only the response table
+		resp = resp_alloc(&cap, profile, absmu);
+		for(i=0; i<thread_cnt; i++){
+			resp_merge(resp,calc[i].resp);
+			resp_free(calc[i].resp);
+			}
+		resp_write(opts.response_out, &cap, profile, absmu, resp);
+		printf("Response table written to %s\n",opts.response_out);
+		} else if(opts.n_part > 1){ //worker of a distributed run: only store the raw accumulators
+		sprintf(f_part,"%s.part%d",cap.out,opts.part);
+		write_partial(f_part, &cap, absmu, profile, leaks, sum_cnt, absorb_sum, sum_istart, sum_ienter, sum_refl);
+		printf("Partial result written to %s\n",f_part);
+		} else {
+		if(!opts.noxy){ //per-photon records, the exit statistics are in the .stat file
+			fptr = fopen("xy.dat","w"); //stores coordinates of photon on screen(xm, ym), as well as direction(xm1,ym1)
+			if(IMSIZE > cap.ndet) arrsize = cap.ndet+1;
+				 else arrsize = IMSIZE;
+			fprintf(fptr,"%d\n",arrsize);
+			fprintf(fptr,"%f\n",e);
+			fprintf(fptr,"%f\n",cap.e_start);
+			fprintf(fptr,"%f\n",dist);
+			for(i=0; i<arrsize; i++){
+				fprintf(fptr,"%f\t%f\t%f\t%f\t%f\n",imstr[i].xm,imstr[i].xm1,imstr[i].ym,imstr[i].ym1,imstr[i].warr);
+				}
+			fclose(fptr);
 
-	fptr = fopen("xys.dat","w"); //coordinates and direction of photon from source origin
-	fprintf(fptr,"%d\n",arrsize);
-	fprintf(fptr,"%f\n",e);
-        fprintf(fptr,"%f\n",cap.e_start);
-        fprintf(fptr,"%f\n",dist);
-        for(i=0; i<arrsize; i++){
-		fprintf(fptr,"%f\t%f\t%f\t%f\t%f\n",imstr[i].xsou,imstr[i].xsou1,imstr[i].ysou,imstr[i].ysou1,imstr[i].wsou);
-		}
-	fclose(fptr);
+			fptr = fopen("xys.dat","w"); //coordinates and direction of photon from source origin
+			fprintf(fptr,"%d\n",arrsize);
+			fprintf(fptr,"%f\n",e);
+			fprintf(fptr,"%f\n",cap.e_start);
+			fprintf(fptr,"%f\n",dist);
+			for(i=0; i<arrsize; i++){
+				fprintf(fptr,"%f\t%f\t%f\t%f\t%f\n",imstr[i].xsou,imstr[i].xsou1,imstr[i].ysou,imstr[i].ysou1,imstr[i].wsou);
+				}
+			fclose(fptr);
+			}
 
-	fptr = fopen("spot.dat","w");
-	fprintf(fptr,"%d\t%d\n",NSPOT,NSPOT);
-	for(j=0; j<NSPOT; j++){
-		for(i=0; i<NSPOT; i++){
-			fprintf(fptr,"%f\t",leaks->spot[i][j]);
+		if(!opts.nospot) write_spot_files(&cap,absmu,leaks,nspot);
+		write_out(argv[1], &cap, profile, &pcap_ini, absmu, leaks, sum_cnt, absorb_sum, sum_istart, sum_ienter, ave_refl);
+		write_stats(&cap, absmu, leaks);
+		if(qmc != NULL){
+			qcnt = calloc(qmc->n_rep*(absmu->n_energy+1),sizeof(*qcnt));
+			qstart = calloc(qmc->n_rep,sizeof(*qstart));
+			if(qcnt == NULL || qstart == NULL){
+				printf("Could not allocate qmc memory.\n");
+				exit(0);
+				}
+			for(i=0; i<thread_cnt; i++){
+				for(j=0; j<qmc->n_rep*(absmu->n_energy+1); j++) qcnt[j] = qcnt[j] + calc[i].qcnt[j];
+				for(j=0; j<qmc->n_rep; j++) qstart[j] = qstart[j] + calc[i].qstart[j];
+				}
+			write_qmc(&cap, absmu, qmc->n_rep, qcnt, qstart);
+			free(qcnt);
+			free(qstart);
 			}
-		fprintf(fptr,"\n");
-		}
-	fclose(fptr);
-	
-	fptr = fopen("lspot.dat","w");
-	fprintf(fptr,"%d\t%d\n",NSPOT,NSPOT);
-	for(j=0; j<NSPOT; j++){
-		for(i=0; i<NSPOT; i++){
-			fprintf(fptr,"%f\t",leaks->lspot[i][j]);
+		if(opts.chanmap){
+			for(i=1; i<thread_cnt; i++) chan_merge(calc[0].chan_map, calc[i].chan_map);
+			write_chan(&cap, &pcap_ini, absmu, calc[0].chan_map);
 			}
-		fprintf(fptr,"\n");
-		}
-	fclose(fptr);
 
-	fptr = fopen(cap.out,"w");
-	if(fptr == NULL){
-		printf("Trouble with output...\n");
-		exit(0);
-		}
-	fprintf(fptr,"Surface roughness [Angstrom]:\t %f\n",cap.sig_rough);
-	fprintf(fptr,"Amplitude of Waviness [cm]:\t %f\n",cap.sig_wave);
-	fprintf(fptr,"Waviness corr. length [cm]:\t %f\n",cap.corr_length);
-	fprintf(fptr,"Source distance [cm]:\t\t %f\n",cap.d_source);
-	fprintf(fptr,"Screen distance [cm]:\t\t %f\n",cap.d_screen);
-	fprintf(fptr,"Source diameter [cm]:\t\t %f\n",cap.src_x*2.);
-	fprintf(fptr,"Capillary foc. distances [cm]:\t %f\t%f\n",cap.src_sigx,cap.src_sigy);//this is not what's written here...
-	fprintf(fptr,"Number of channels:\t\t %5.0f\n",cap.n_chan);
-	fprintf(fptr,"Calculated capillary open area:\t %5.3f\n",pcap_ini.eta);
-	fprintf(fptr,"Misalignment rotation [rad]/translation [cm]: %f\t%f\n",cap.src_shiftx,cap.src_shifty); //only translation
-	fprintf(fptr,"Capillary profile: %s\n",cap.prf);
-	fprintf(fptr,"Capillary axis   : %s\n",cap.axs);
-	fprintf(fptr,"External profile : %s\n",cap.ext);
-	fprintf(fptr,"Input file       : %s\n",argv[1]);
-	fprintf(fptr,"  E [keV]      I/I0\n");
-	fprintf(fptr,"$DATA:\n");
-	fprintf(fptr,"%d\t%d\n",absmu->n_energy+1,5);
-	for(i=0; i<=absmu->n_energy; i++){
-		fprintf(fptr,"%8.2f\t%10.9f\t%10.9f\t%10.9f\t%10.9f\n",cap.e_start+i*cap.delta_e,
-			sum_cnt[i]/(float)sum_ienter*pcap_ini.eta, sum_cnt[i]/(float)sum_istart,
-			(float)sum_ienter/(float)sum_istart, leaks->leak[i]/(float)sum_ienter);
+		new_seed = part_seed(lib.rseed,1);
+		fptr = fopen("random.dat","w");
+		fprintf(fptr,"%lf\n",new_seed);
+		printf("New seed: %lf\n",new_seed);
+		fclose(fptr);
 		}
-	fprintf(fptr,"\nThe started photons: %ld\n",sum_istart);
-	fprintf(fptr,"\nAverage number of reflections: %f\n",ave_refl);
-	fclose(fptr);
-
-	new_seed = gsl_rng_uniform(calc[0].rn)*2147483647.;
-	fptr = fopen("random.dat","w");
-	fprintf(fptr,"%lf\n",new_seed);
-	printf("New seed: %lf\n",new_seed);
-	fclose(fptr);
-
-	sprintf(f_abs,"%s.abs",cap.out);
-	fptr = fopen(f_abs,"w");
-	fprintf(fptr,"$DATA:\n");
-	fprintf(fptr,"%d\t%d\n",profile->nmax,2);
-	for(i=0;i<=profile->nmax;i++) fprintf(fptr,"%f\t%f\n",profile->arr[i].zarr,absorb_sum[i]);
-	fclose(fptr);
 
 
 	// free allocated memory
@@ -1183,21 +5656,33 @@ int main(int argc, char *argv[])
 		free(calc[i].absorb);
 		free(calc[i].w);
 		free(calc[i].cnt);
+		free_leak(&cap,calc[i].leaks);
+		free(calc[i].bounce);
+		free(calc[i].hbuf);
+		free(calc[i].ebuf);
+		free(calc[i].zbuf);
+		free(calc[i].qcnt);
+		free(calc[i].qstart);
+		if(calc[i].chan_map != NULL) chan_free(calc[i].chan_map);
 		}
+	if(qmc != NULL) qmc_free(qmc);
+	if(resp != NULL) resp_free(resp);
+	if(wave != NULL) wave_free(wave);
+	if(zcache != NULL) zcache_free(zcache);
+	if(cap.source != NULL) source_free(cap.source);
+	if(tune != NULL) free(tune);
 	free(calc);
 	free(profile->arr);
+	free(profile->shape);
 	free(profile);
 	free(imstr);
 	free(ctvar->w);
 	free(ctvar);
-	free(sum_irefl);
-	free(seed);
 	free(absorb_sum);
 	free(sum_cnt);
 	free(absmu->arr);
 	free(absmu);
-	free(leaks->leak);
-	free(leaks);
+	free_leak(&cap,leaks);
 	return 0;
 	}
 // ---------------------------------------------------------------------------------------------------
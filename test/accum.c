@@ -0,0 +1,70 @@
+// Exactness of the accumulators of the reduction path far beyond the 2^24 photon weights at which a
+// float accumulator stops growing: transmitted (cnt) and leaked (leak) weight per energy and the spot map
+// tiles, including their reduction over threads (spot_merge). The photon weights 1 and 0.375 keep every
+// partial sum exactly representable in double, so the totals are compared for equality.
+// Usage: accum_test [n_photon], 10^9 photons by default. Returns 0 if all totals are exact.
+#define main polycap_main
+#include "../src/polycap.c"
+#undef main
+
+// ---------------------------------------------------------------------------------------------------
+int check(char *name, double value, double expected)
+	{
+	printf("%-24s %.1f (expected %.1f)%s\n",name,value,expected,(value == expected) ? "" : "  FAILED");
+
+	return value == expected;
+	}
+// ---------------------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+	{
+	long i, n_photon;
+	int ok=1;
+	float w[2] = {1., 0.375}; //photon weights, per energy
+	struct calcstruct calc;
+	struct leakstruct leaks;
+	struct spot_map *spot, *sum_spot;
+
+	n_photon = (argc > 1) ? atol(argv[1]) : 1000000000L;
+	if(n_photon <= 16777216L){
+		printf("At least 2^24 photons are needed to test saturation.\n");
+		return 1;
+		}
+	//the accumulators of the run, so that they are tested at the precision the tracer uses
+	calc.cnt = calloc(2,sizeof(*calc.cnt));
+	leaks.leak = calloc(2,sizeof(*leaks.leak));
+	spot = spot_alloc(1.e-4,2);
+	sum_spot = spot_alloc(1.e-4,2);
+	if(calc.cnt == NULL || leaks.leak == NULL){
+		printf("Could not allocate accumulator memory.\n");
+		return 1;
+		}
+
+	//as count() and reflect() add a transmitted or leaked photon
+	for(i=0; i<n_photon; i++){
+		calc.cnt[0] += w[0];
+		calc.cnt[1] += w[1];
+		leaks.leak[0] += w[0];
+		leaks.leak[1] += w[1];
+		spot_add(spot, 1.5e-4, -2.5e-4, 0, w[0]);
+		spot_add(spot, 1.5e-4, -2.5e-4, 1, w[1]);
+		}
+	//two threads' maps reduced into one
+	spot_merge(sum_spot, spot);
+	spot_merge(sum_spot, spot);
+
+	ok &= check("cnt, weight 1",calc.cnt[0],(double)n_photon);
+	ok &= check("cnt, weight 0.375",calc.cnt[1],0.375*n_photon);
+	ok &= check("leak, weight 1",leaks.leak[0],(double)n_photon);
+	ok &= check("leak, weight 0.375",leaks.leak[1],0.375*n_photon);
+	ok &= check("spot, weight 1",spot_get(spot,1,-3,0),(double)n_photon);
+	ok &= check("spot, weight 0.375",spot_get(spot,1,-3,1),0.375*n_photon);
+	ok &= check("merged spot, weight 1",spot_get(sum_spot,1,-3,0),2.*n_photon);
+	ok &= check("merged spot, weight 0.375",spot_get(sum_spot,1,-3,1),0.75*n_photon);
+
+	spot_free(spot);
+	spot_free(sum_spot);
+	free(calc.cnt);
+	free(leaks.leak);
+
+	return ok ? 0 : 1;
+	}